@@ -2,7 +2,7 @@
  *
  * csim.c - A cache simulator that can replay traces from Valgrind
  *     and output statistics such as number of hits, misses, and
- *     evictions.  The replacement policy is LRU.
+ *     evictions.  The replacement policy is LRU unless -p picks another.
  *
  * Implementation and assumptions:
  *  1. Each load/store can cause at most one cache miss plus a possible eviction.
@@ -26,329 +26,6081 @@
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "csim.h"
 
+/* Built as a library, only the csim_* calls of csim.h are exported */
+#ifdef CSIM_LIBRARY
+#define CSIM_INTERNAL static __attribute__((unused))
+#else
+#define CSIM_INTERNAL
+#endif
 
 /* Globals set by command line args */
-int verbosity = 0; /* print trace if set */
-int s = 0; /* set index bits */
-int b = 0; /* block offset bits */
-int E = 0; /* associativity */
-char* trace_file = NULL;
-
-/* Derived from command line args */
-int S; /* number of sets S = 2^s In C, you can use the left shift operator */
-int B; /* block size (bytes) B = 2^b */
-
-/* Counters used to record cache statistics */
-int miss_count = 0;
-int hit_count = 0;
-int eviction_count = 0;
+CSIM_INTERNAL int verbosity = 0; /* print trace if set */
+CSIM_INTERNAL int nthreads = 1; /* worker threads for sweeps or set shards */
+CSIM_INTERNAL int write_stats = 0; /* print write traffic if set */
+CSIM_INTERNAL int split_lines = 0; /* split accesses that cross blocks if set */
+CSIM_INTERNAL int detail_top = 10; /* rows of each --detail table */
+CSIM_INTERNAL int write_results = 0; /* write .csim_results for the autograder if set */
+CSIM_INTERNAL int readahead = -1; /* batches the reader thread decodes ahead, -1 until picked */
+CSIM_INTERNAL char* checkpoint_file = "csim.ckpt"; /* where --checkpoint-every writes */
+CSIM_INTERNAL unsigned long long checkpoint_every = 0; /* accesses between checkpoints, or 0 */
+CSIM_INTERNAL FILE* report_fp = NULL; /* stdout kept for the report of --output - */
+
 /*****************************************************************************/
 
 
+/* Type: Geometry
+ * One (s, E, b) cache configuration of a sweep
+ */
+typedef struct geometry {
+    int s;
+    int E;
+    int b;
+} geometry_t;
+
 /* Type: Memory address 
  * Use this type whenever dealing with addresses or address masks
  */
 typedef unsigned long long int mem_addr_t;
 
-/* Type: Cache line
+/* Type: Replacement policy
+ * Chosen with -p; see the policy hooks below initCache()
+ */
+typedef enum policy {
+    POLICY_LRU,
+    POLICY_FIFO,
+    POLICY_RANDOM,
+    POLICY_PLRU,
+    POLICY_SRRIP,
+    POLICY_BRRIP,
+    POLICY_LFU,
+    NUM_POLICIES
+} policy_t;
+
+/* Names accepted by -p, indexed by policy_t */
+CSIM_INTERNAL const char* policy_names[NUM_POLICIES] = {
+    "lru", "fifo", "random", "plru", "srrip", "brrip", "lfu"
+};
+
+/* Type: Write policy
+ * Flags for how a cache handles stores; 0 is write-back, write-allocate
+ */
+typedef enum write_mode {
+    WRITE_THROUGH = 1,      /* stores go to memory instead of dirtying the line */
+    WRITE_NO_ALLOCATE = 2   /* store misses do not fill a line */
+} write_mode_t;
+
+/* Type: Cache
+ * All tags, valid bits and replacement state live in one aligned block.
+ * Each per-line array is set-major: the line for (set, way) is at index
+ * set*E + way.
+ * repl[] is the policy's per-line state: the access clock at the last use
+ * (LRU) or at the fill (FIFO), the use count (LFU) or the re-reference
+ * prediction value (RRIP). The first three keep 0 in invalid lines, so
+ * the way with the smallest value is the one to replace.
+ * pstate[] is one word per set: the PLRU tree bits, or the random number
+ * state of the random and BRRIP policies, which keeps each set's choices
+ * independent of how the sets are spread over threads.
+ * dirty[] marks the lines a write-back cache must write out on eviction.
+ * prefetched[] marks the lines a prefetcher filled that no demand access
+ * has used yet.
+ * Invalid lines hold TAG_INVALID, which no address can produce since
+ * s + b >= 1, so the tag probe never has to look at the valid bits.
+ */
+typedef struct cache {
+    /* Geometry */
+    int s;    /* set index bits */
+    int E;    /* associativity */
+    int b;    /* block offset bits */
+    size_t S; /* number of sets S = 2^s */
+    policy_t policy;
+    int write_mode; /* write_mode_t flags */
+    bool split_lines; /* split accesses across the blocks they touch */
+
+    /* Counters used to record cache statistics */
+    unsigned long long miss_count;
+    unsigned long long hit_count;
+    unsigned long long eviction_count;
+    unsigned long long dirty_eviction_count;
+    unsigned long long write_bytes; /* written to the level below */
+    unsigned long long write_count; /* writes to the level below */
+    unsigned long long line_crossing_count; /* accesses split over several blocks */
+    unsigned long long useful_prefetch_count; /* demand hits on prefetched lines */
+    unsigned long long polluting_prefetch_count; /* prefetched lines evicted unused */
+
+    struct prefetcher* prefetcher; /* NULL unless --prefetch */
+    struct detail* detail; /* NULL unless --detail */
+    struct sampling* sampling; /* NULL unless --sample-sets or --sample-time */
+    struct interval* interval; /* NULL unless --interval */
+    struct tlb* tlb; /* NULL unless --tlb */
+
+    unsigned long long clock; /* accesses so far, for repl[] */
+
+    size_t block_size; /* bytes of block, which holds all the arrays below */
+    mem_addr_t* tag;
+    unsigned long long* repl;
+    uint64_t* pstate;
+    char* valid;
+    char* dirty;
+    char* prefetched;
+    void* block;
+} cache_t;
+
+/* Alignment of the cache block, one host cache line */
+#define CACHE_ALIGN 64
+
+/* Tag stored in lines that hold no data */
+#define TAG_INVALID (~(mem_addr_t)0)
+
+/*
+ * Tag probes - compare one tag against n <= 64 consecutive tags and
+ * return a bitmask with bit i set if tags[i] matches. At most one way of
+ * a set can match, so callers only ever look at the lowest set bit.
+ */
+typedef uint64_t (*probe_fn)(const mem_addr_t* tags, int n, mem_addr_t t);
+
+static uint64_t probeScalar(const mem_addr_t* tags, int n, mem_addr_t t)
+{
+    uint64_t mask = 0;
+    for(int i = 0; i < n; i++)
+        mask |= (uint64_t)(tags[i] == t) << i;
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint64_t probeSSE2(const mem_addr_t* tags, int n, mem_addr_t t)
+{
+    //SSE2 has no 64-bit compare, so AND each 32-bit half with its partner
+    __m128i key = _mm_set1_epi64x(t);
+    uint64_t mask = 0;
+    int i = 0;
+    for(; i + 2 <= n; i += 2) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(tags + i)), key);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        mask |= (uint64_t)_mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+    }
+    if(i < n)
+        mask |= (uint64_t)(tags[i] == t) << i;
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t probeAVX2(const mem_addr_t* tags, int n, mem_addr_t t)
+{
+    __m256i key = _mm256_set1_epi64x(t);
+    uint64_t mask = 0;
+    int i = 0;
+    for(; i + 4 <= n; i += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(tags + i)), key);
+        mask |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(eq)) << i;
+    }
+    for(; i < n; i++)
+        mask |= (uint64_t)(tags[i] == t) << i;
+    return mask;
+}
+
+__attribute__((target("avx512f")))
+static uint64_t probeAVX512(const mem_addr_t* tags, int n, mem_addr_t t)
+{
+    //masked loads cover the tail, so a set of up to 8 ways is one compare
+    __m512i key = _mm512_set1_epi64(t);
+    uint64_t mask = 0;
+    for(int i = 0; i < n; i += 8) {
+        __mmask8 live = n - i >= 8 ? 0xff : (__mmask8)((1u << (n - i)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi64(live, tags + i);
+        mask |= (uint64_t)_mm512_mask_cmpeq_epi64_mask(live, v, key) << i;
+    }
+    return mask;
+}
+#elif defined(__aarch64__)
+static uint64_t probeNEON(const mem_addr_t* tags, int n, mem_addr_t t)
+{
+    uint64x2_t key = vdupq_n_u64(t);
+    uint64_t mask = 0;
+    int i = 0;
+    for(; i + 2 <= n; i += 2) {
+        uint64x2_t eq = vceqq_u64(vld1q_u64((const uint64_t*)(tags + i)), key);
+        mask |= (vgetq_lane_u64(eq, 0) & 1) << i;
+        mask |= (vgetq_lane_u64(eq, 1) & 1) << (i + 1);
+    }
+    if(i < n)
+        mask |= (uint64_t)(tags[i] == t) << i;
+    return mask;
+}
+#endif
+
+/*
+ * pickProbe - choose the widest tag probe the running CPU supports
+ */
+static probe_fn pickProbe()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f"))
+        return probeAVX512;
+    if(__builtin_cpu_supports("avx2"))
+        return probeAVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return probeSSE2;
+#elif defined(__aarch64__)
+    return probeNEON;
+#endif
+    return probeScalar;
+}
+
+/* The tag probe used by accessData(), picked by the first initCache() */
+CSIM_INTERNAL probe_fn probe;
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+
+/*
+ * initProbe - pick the tag probe unless one was already chosen
+ */
+static void initProbe(void)
+{
+    if(!probe)
+        probe = pickProbe();
+}
+
+/*
+ * listProbes - fill fns and names with every tag probe the running CPU
+ * supports, narrowest first, and return how many there are
  */
-typedef struct cache_line {
-    char valid;
-    mem_addr_t tag;
-    struct cache_line * next;
-} cache_line_t;
+static int listProbes(probe_fn* fns, const char** names)
+{
+    int n = 0;
+    fns[n] = probeScalar;
+    names[n++] = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) {
+        fns[n] = probeSSE2;
+        names[n++] = "sse2";
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        fns[n] = probeAVX2;
+        names[n++] = "avx2";
+    }
+    if(__builtin_cpu_supports("avx512f")) {
+        fns[n] = probeAVX512;
+        names[n++] = "avx512";
+    }
+#elif defined(__aarch64__)
+    fns[n] = probeNEON;
+    names[n++] = "neon";
+#endif
+    return n;
+}
 
-typedef cache_line_t* cache_set_t;
-typedef cache_set_t* cache_t;
+/* Most tag probes listProbes() can return */
+#define MAX_PROBES 4
 
+/* Largest re-reference prediction value of the 2-bit RRIP policies */
+#define RRPV_MAX 3
 
-/* The cache we are simulating */
-cache_t cache;  
+/* BRRIP inserts near instead of distant once every BRRIP_NEAR fills */
+#define BRRIP_NEAR 32
+
+/*
+ * nextRandom - advance a per-set xorshift state and return its new value
+ */
+static inline uint64_t nextRandom(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
 
 /* 
- * initCache - 
- * Allocate data structures to hold info regrading the sets and cache lines
- * use struct "cache_line_t" here
- * Initialize valid and tag field with 0s.
- * use S (= 2^s) and E while allocating the data structures here
+ * setupCache - the work of initCache(); returns 0, or EINVAL if policy
+ * cannot run with E ways or ENOMEM if the block cannot be allocated, and
+ * then leaves nothing allocated
  */
-void initCache()
+static int setupCache(cache_t* cache, int s, int E, int b, policy_t policy, int write_mode)
 { 
-  //get S
-  S = pow(2,s);
- 
-  //create ian array to hold the sets
-  cache = malloc(sizeof(cache_set_t)*S);
-  
-  //create a pointer to the previous cache line 
-  cache_line_t* prev;
- 
-  for(int i = 0; i < S; i++) {
-    	//make a set pointer
-    	cache_set_t set;
-     
-     //allocate the first cache line of the set
-    	set  = (cache_set_t) malloc(sizeof(cache_line_t));
-    	//mark the valid and tag to be 0
-    	set->valid = 0;
-    	set->tag = 0;
-    	set->next = NULL;
-            //make the first line = to prev
-    	prev = set;
-    	//add the first set to the array of sets
-     	cache[i] = set;
-      
-          	//for each of the remaining lines in each set, set the next
-           	for(int j = 1; j < E; j++) {
-               //allocate a new line 
-          	   cache_set_t line = malloc(sizeof(cache_line_t));
-          	   //set this new line as the next for the previous
-          	   prev->next = line;	   
-          	   //update previous to the new line
-          	   prev = line;	  
-          	   //mark valid and tag to be 0
-          	   line->valid = 0;
-          	   line->tag = 0;
-          	   line->next = NULL; 
-            }
+    if(policy == POLICY_PLRU && (E > 64 || (E & (E - 1))))
+        return EINVAL;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->s = s;
+    cache->E = E;
+    cache->b = b;
+    cache->S = (size_t)1 << s;
+    cache->policy = policy;
+    cache->write_mode = write_mode;
+    size_t lines = cache->S * E;
+
+    //lay the arrays out back to back, widest first so each stays aligned
+    size_t tag_bytes = lines * sizeof(mem_addr_t);
+    size_t repl_bytes = lines * sizeof(unsigned long long);
+    size_t pstate_bytes = cache->S * sizeof(uint64_t);
+    size_t size = tag_bytes + repl_bytes + pstate_bytes + 3 * lines;
+    size = (size + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+
+    cache->block = aligned_alloc(CACHE_ALIGN, size);
+    if(!cache->block)
+        return ENOMEM;
+    memset(cache->block, 0, size);
+    cache->block_size = size;
+
+    cache->tag = cache->block;
+    cache->repl = (unsigned long long*)((char*)cache->block + tag_bytes);
+    cache->pstate = (uint64_t*)((char*)cache->block + tag_bytes + repl_bytes);
+    cache->valid = (char*)cache->block + tag_bytes + repl_bytes + pstate_bytes;
+    cache->dirty = cache->valid + lines;
+    cache->prefetched = cache->dirty + lines;
+
+    //no line holds a valid tag yet
+    for(size_t i = 0; i < lines; i++)
+        cache->tag[i] = TAG_INVALID;
+
+    //seed every set's random state differently, and never with 0
+    if(policy == POLICY_RANDOM || policy == POLICY_BRRIP)
+        for(size_t i = 0; i < cache->S; i++)
+            cache->pstate[i] = (i + 1) * 0x9e3779b97f4a7c15ULL;
+
+    pthread_once(&probe_once, initProbe);
+    return 0;
+}
+
+/* 
+ * initCache - 
+ * Allocate one block to hold the tags, valid bits and replacement state
+ * of every line of a cache with 2^s sets of E lines of 2^b bytes, that
+ * replaces lines by policy and handles stores by write_mode, carve it
+ * into its arrays and clear it.
+ */
+CSIM_INTERNAL void initCache(cache_t* cache, int s, int E, int b, policy_t policy, int write_mode)
+{
+    int err = setupCache(cache, s, E, b, policy, write_mode);
+    if(err == EINVAL) {
+        fprintf(stderr, "initCache: plru needs a power of 2 associativity up to 64, not %d\n", E);
+        exit(1);
+    }
+    if(err) {
+        fprintf(stderr, "initCache: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+/* 
+ * freeCache - free the block allocated inside initCache()
+ */
+CSIM_INTERNAL void freeCache(cache_t* cache)
+{
+    free(cache->block);
+    cache->block = NULL;
+}
+
+/* Accesses simulate_P decodes at a time, and how far ahead of the access
+ * being simulated it prefetches the tags of the set to probe */
+#define DECODE_CHUNK 256
+#define PROBE_AHEAD 8
+
+/*
+ * decodeRun - split each of the n addresses into its set index and tag;
+ * a branch-free loop the compiler vectorizes
+ */
+static inline void decodeRun(const cache_t* cache, const mem_addr_t* addrs, int n,
+                             size_t* sets, mem_addr_t* tags)
+{
+    int b = cache->b;
+    int sb = cache->s + cache->b;
+    size_t mask = cache->S - 1;
+    for(int i = 0; i < n; i++) {
+        sets[i] = (addrs[i] >> b) & mask;
+        tags[i] = addrs[i] >> sb;
+    }
+}
+
+/*
+ * Policy hooks. For each policy P:
+ *   P##Hit(E, repl, ps, way, now)     update the state after a hit on way
+ *   P##Victim(E, valid, repl, ps)     pick the way to fill on a miss
+ *   P##Fill(E, repl, ps, way, now)    update the state after filling way
+ * repl is the set's slice of cache->repl, ps its pstate word and now the
+ * cache's access clock. DEFINE_POLICY instantiates the access loop with
+ * the hooks inlined, so there is no per-access policy dispatch.
+ */
+
+/*
+ * oldestWay - way with the smallest repl value, the first on ties
+ */
+static inline int oldestWay(int E, const unsigned long long* repl)
+{
+    int way = 0;
+    unsigned long long oldest = repl[0];
+    for(int w = 1; w < E; w++)
+        if(repl[w] < oldest) {
+            oldest = repl[w];
+            way = w;
+        }
+    return way;
+}
+
+/*
+ * openWay - the first invalid way of a set, or -1 if the set is full
+ */
+static inline int openWay(int E, const char* valid)
+{
+    const char* open = memchr(valid, 0, E);
+    return open ? open - valid : -1;
+}
+
+/* LRU: repl is the clock at the last use */
+static inline void lruHit(int E, unsigned long long* repl, uint64_t* ps, int way, unsigned long long now)
+{
+    (void)E; (void)ps;
+    repl[way] = now;
+}
+
+static inline int lruVictim(int E, const char* valid, unsigned long long* repl, uint64_t* ps)
+{
+    (void)valid; (void)ps;
+    return oldestWay(E, repl);
+}
+
+#define lruFill lruHit
+
+/* FIFO: repl is the clock at the fill; hits change nothing */
+static inline void fifoHit(int E, unsigned long long* repl, uint64_t* ps, int way, unsigned long long now)
+{
+    (void)E; (void)repl; (void)ps; (void)way; (void)now;
+}
+
+#define fifoVictim lruVictim
+#define fifoFill lruHit
+
+/* Random: an open way if there is one, else any way */
+#define randomHit fifoHit
+
+static inline int randomVictim(int E, const char* valid, unsigned long long* repl, uint64_t* ps)
+{
+    (void)repl;
+    int way = openWay(E, valid);
+    return way >= 0 ? way : (int)(nextRandom(ps) % E);
+}
+
+#define randomFill fifoHit
+
+/*
+ * PLRU: a binary tree over the ways with node n's children at 2n and
+ * 2n+1 and way w at leaf E+w. A set bit in node n means the victim lies
+ * in its right subtree; every access points the path away from its way.
+ */
+static inline void plruHit(int E, unsigned long long* repl, uint64_t* ps, int way, unsigned long long now)
+{
+    (void)repl; (void)now;
+    uint64_t bits = *ps;
+    for(unsigned int n = E + way; n > 1; n >>= 1) {
+        uint64_t node = (uint64_t)1 << (n >> 1);
+        bits = n & 1 ? bits & ~node : bits | node;
+    }
+    *ps = bits;
+}
+
+static inline int plruVictim(int E, const char* valid, unsigned long long* repl, uint64_t* ps)
+{
+    (void)repl;
+    int way = openWay(E, valid);
+    if(way >= 0)
+        return way;
+    unsigned int n = 1;
+    while(n < (unsigned int)E)
+        n = 2 * n + (*ps >> n & 1);
+    return n - E;
+}
+
+#define plruFill plruHit
+
+/*
+ * SRRIP/BRRIP: repl is the re-reference prediction value. Hits predict
+ * near reuse; the victim is the first line predicted most distant, after
+ * ageing the whole set until there is one.
+ */
+static inline void srripHit(int E, unsigned long long* repl, uint64_t* ps, int way, unsigned long long now)
+{
+    (void)E; (void)ps; (void)now;
+    repl[way] = 0;
+}
+
+static inline int srripVictim(int E, const char* valid, unsigned long long* repl, uint64_t* ps)
+{
+    (void)ps;
+    int way = openWay(E, valid);
+    if(way >= 0)
+        return way;
+    for(;;) {
+        for(int w = 0; w < E; w++)
+            if(repl[w] == RRPV_MAX)
+                return w;
+        for(int w = 0; w < E; w++)
+            repl[w]++;
+    }
+}
+
+static inline void srripFill(int E, unsigned long long* repl, uint64_t* ps, int way, unsigned long long now)
+{
+    (void)E; (void)ps; (void)now;
+    repl[way] = RRPV_MAX - 1;
+}
+
+#define brripHit srripHit
+#define brripVictim srripVictim
+
+static inline void brripFill(int E, unsigned long long* repl, uint64_t* ps, int way, unsigned long long now)
+{
+    (void)E; (void)now;
+    repl[way] = nextRandom(ps) % BRRIP_NEAR ? RRPV_MAX : RRPV_MAX - 1;
+}
+
+/* LFU: repl is the use count, the first of the least used lines goes */
+static inline void lfuHit(int E, unsigned long long* repl, uint64_t* ps, int way, unsigned long long now)
+{
+    (void)E; (void)ps; (void)now;
+    repl[way]++;
+}
+
+#define lfuVictim lruVictim
+
+static inline void lfuFill(int E, unsigned long long* repl, uint64_t* ps, int way, unsigned long long now)
+{
+    (void)E; (void)ps; (void)now;
+    repl[way] = 1;
+}
+
+/*
+ * crossesLine - true if the len bytes at addr span more than one block
+ * of 2^b bytes. An access of size 0 touches one byte.
+ */
+static inline bool crossesLine(mem_addr_t addr, unsigned int len, int b)
+{
+    return len > 1 && (addr >> b) != ((addr + len - 1) >> b);
+}
+
+/*
+ * nextPiece - the end of the piece of [addr, end) that lies within the
+ * block of addr
+ */
+static inline mem_addr_t nextPiece(mem_addr_t addr, mem_addr_t end, int b)
+{
+    mem_addr_t next = ((addr >> b) + 1) << b;
+    return next < end ? next : end;
+}
+
+/* Type: Pieces
+ * The pieces one access is simulated as, taken in order by takePiece():
+ * with split set, one per block of 2^b bytes an access crossing a block
+ * boundary touches, otherwise the whole access
+ */
+typedef struct pieces {
+    mem_addr_t addr, end; /* the part left to split */
+    unsigned int len;     /* of the whole access */
+    int b;
+    bool whole;           /* the whole access is still to be taken */
+} pieces_t;
+
+/*
+ * piecesOf - the pieces of the len bytes at addr; a split access counts
+ * in *crossings unless crossings is NULL
+ */
+static inline pieces_t piecesOf(mem_addr_t addr, unsigned int len, int b, bool split,
+                                unsigned long long* crossings)
+{
+    pieces_t p = { addr, addr, len, b, true };
+    if(split && crossesLine(addr, len, b)) {
+        p.end = addr + len;
+        p.whole = false;
+        if(crossings)
+            (*crossings)++;
+    }
+    return p;
+}
+
+/*
+ * takePiece - the next piece of p in *addr and *len; false once none is
+ * left
+ */
+static inline bool takePiece(pieces_t* p, mem_addr_t* addr, unsigned int* len)
+{
+    if(p->whole) {
+        p->whole = false;
+        *addr = p->addr;
+        *len = p->len;
+        return true;
+    }
+    if(p->addr >= p->end)
+        return false;
+    mem_addr_t next = nextPiece(p->addr, p->end, p->b);
+    *addr = p->addr;
+    *len = next - p->addr;
+    p->addr = next;
+    return true;
+}
+
+/*
+ * DEFINE_POLICY - instantiate, for policy P,
+ *   lookup_P(cache, set, tag)      the way holding tag, a hit, or -1
+ *   insert_P(cache, set, tag, &v, &d)
+ *                                  fill tag into an open or evicted line and
+ *                                  return its way; *d is set if tag *v was
+ *                                  evicted for it, to 2 if it was dirty
+ *   access_P(cache, op, addr, len) one access, as described for accessData()
+ *   simulate_P(cache, ops, addrs, lens, n)
+ *                                  n accesses in order, each split into one
+ *                                  access per block if cache->split_lines
+ */
+#define DEFINE_POLICY(P)                                                    \
+static inline int lookup_##P(cache_t* cache, size_t s_bits, mem_addr_t t_bits) \
+{                                                                           \
+    int E = cache->E;                                                       \
+    mem_addr_t* tag = cache->tag + s_bits * E;                              \
+                                                                            \
+    /* compare the tag against every way of the set at once */              \
+    for(int w = 0; w < E; w += 64) {                                        \
+        uint64_t hit = probe(tag + w, E - w < 64 ? E - w : 64, t_bits);     \
+        if(hit) {                                                           \
+            int way = w + __builtin_ctzll(hit);                             \
+            cache->hit_count++;                                             \
+            if(cache->prefetched[s_bits * E + way]) {                       \
+                cache->useful_prefetch_count++;                             \
+                cache->prefetched[s_bits * E + way] = 0;                    \
+            }                                                               \
+            P##Hit(E, cache->repl + s_bits * E, cache->pstate + s_bits,     \
+                   way, ++cache->clock);                                    \
+            return way;                                                     \
+        }                                                                   \
+    }                                                                       \
+    cache->miss_count++;                                                    \
+    return -1;                                                              \
+}                                                                           \
+                                                                            \
+static inline int insert_##P(cache_t* cache, size_t s_bits, mem_addr_t t_bits, \
+                             mem_addr_t* victim, int* evicted)              \
+{                                                                           \
+    int E = cache->E;                                                       \
+    size_t base = s_bits * E;                                               \
+    char* valid = cache->valid + base;                                      \
+    unsigned long long* repl = cache->repl + base;                          \
+    uint64_t* ps = cache->pstate + s_bits;                                  \
+                                                                            \
+    /* fill an open line or evict one, writing it back if dirty */          \
+    int way = P##Victim(E, valid, repl, ps);                                \
+    *evicted = valid[way] ? 1 + cache->dirty[base + way] : 0;               \
+    if(*evicted) {                                                          \
+        cache->eviction_count++;                                            \
+        *victim = cache->tag[base + way];                                   \
+        if(cache->dirty[base + way]) {                                      \
+            cache->dirty_eviction_count++;                                  \
+            cache->write_count++;                                           \
+            cache->write_bytes += (unsigned long long)1 << cache->b;        \
+            cache->dirty[base + way] = 0;                                   \
+        }                                                                   \
+        if(cache->prefetched[base + way]) {                                 \
+            cache->polluting_prefetch_count++;                              \
+            cache->prefetched[base + way] = 0;                              \
+        }                                                                   \
+    }                                                                       \
+    cache->tag[base + way] = t_bits;                                        \
+    valid[way] = 1;                                                         \
+    P##Fill(E, repl, ps, way, ++cache->clock);                              \
+    return way;                                                             \
+}                                                                           \
+                                                                            \
+static inline void accessSet_##P(cache_t* cache, char op, size_t s_bits,   \
+                                 mem_addr_t t_bits, unsigned int len)       \
+{                                                                           \
+    mem_addr_t victim;                                                      \
+    int evicted;                                                            \
+                                                                            \
+    int way = lookup_##P(cache, s_bits, t_bits);                            \
+    if(way < 0) {                                                           \
+        /* without write-allocate a store miss goes straight to memory */   \
+        if(op == 'S' && (cache->write_mode & WRITE_NO_ALLOCATE)) {          \
+            cache->write_count++;                                           \
+            cache->write_bytes += len;                                      \
+            return;                                                         \
+        }                                                                   \
+        way = insert_##P(cache, s_bits, t_bits, &victim, &evicted);         \
+    }                                                                       \
+    if(op == 'S') {                                                         \
+        if(cache->write_mode & WRITE_THROUGH) {                             \
+            cache->write_count++;                                           \
+            cache->write_bytes += len;                                      \
+        } else                                                              \
+            cache->dirty[s_bits * cache->E + way] = 1;                      \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+static inline void access_##P(cache_t* cache, char op, mem_addr_t addr,     \
+                              unsigned int len)                             \
+{                                                                           \
+    /* extract the s bits and the t bits from the address */                \
+    accessSet_##P(cache, op, (addr >> cache->b) & (cache->S - 1),           \
+                  addr >> (cache->s + cache->b), len);                      \
+}                                                                           \
+                                                                            \
+static void simulate_##P(cache_t* cache, const char* ops,                   \
+                         const mem_addr_t* addrs, const unsigned int* lens, int n) \
+{                                                                           \
+    size_t sets[DECODE_CHUNK];                                              \
+    mem_addr_t tags[DECODE_CHUNK];                                          \
+                                                                            \
+    for(int at = 0; at < n; at += DECODE_CHUNK) {                           \
+        int m = n - at < DECODE_CHUNK ? n - at : DECODE_CHUNK;              \
+        decodeRun(cache, addrs + at, m, sets, tags);                        \
+        for(int i = 0; i < m; i++) {                                        \
+            if(i + PROBE_AHEAD < m)                                         \
+                __builtin_prefetch(cache->tag + sets[i + PROBE_AHEAD] * cache->E); \
+            if(cache->split_lines &&                                        \
+               crossesLine(addrs[at + i], lens[at + i], cache->b)) {        \
+                pieces_t p = piecesOf(addrs[at + i], lens[at + i], cache->b, \
+                                      true, &cache->line_crossing_count);   \
+                mem_addr_t a;                                               \
+                unsigned int len;                                           \
+                while(takePiece(&p, &a, &len))                              \
+                    access_##P(cache, ops[at + i], a, len);                 \
+            } else {                                                        \
+                accessSet_##P(cache, ops[at + i], sets[i], tags[i], lens[at + i]); \
+            }                                                               \
+        }                                                                   \
+    }                                                                       \
+}
+
+DEFINE_POLICY(lru)
+DEFINE_POLICY(fifo)
+DEFINE_POLICY(random)
+DEFINE_POLICY(plru)
+DEFINE_POLICY(srrip)
+DEFINE_POLICY(brrip)
+DEFINE_POLICY(lfu)
+
+/*
+ * Dispatch on a cache's policy: POLICY_CASES(call) expands to one switch
+ * case per policy, each running call(P) with P the policy's hook prefix.
+ */
+#define POLICY_CASES(call)                                  \
+    case POLICY_LRU:    call(lru); break;                   \
+    case POLICY_FIFO:   call(fifo); break;                  \
+    case POLICY_RANDOM: call(random); break;                \
+    case POLICY_PLRU:   call(plru); break;                  \
+    case POLICY_SRRIP:  call(srrip); break;                 \
+    case POLICY_BRRIP:  call(brrip); break;                 \
+    case POLICY_LFU:    call(lfu); break;                   \
+    default:            abort()
+
+/* 
+ * accessData - Access data at memory address addr.
+ *   If it is already in cache, increase hit_count
+ *   If it is not in cache, bring it in cache, increase miss count.
+ *   Also increase eviction_count if a line is evicted.
+ *   op is 'L' or 'S'; stores dirty the line or write through to memory,
+ *   and skip the fill on a miss without write-allocate.
+ * Runs of accesses should go through simulateRun() instead, which
+ * dispatches on the policy once per run rather than once per access.
+ */
+CSIM_INTERNAL void accessData(cache_t* cache, char op, mem_addr_t addr, unsigned int len)
+{  
+#define ACCESS(P) access_##P(cache, op, addr, len)
+    switch(cache->policy) {
+    POLICY_CASES(ACCESS);
+    }
+#undef ACCESS
+}
+
+/* access_P() of one policy, for the run loops that take it as a constant */
+typedef void (*access_fn)(cache_t* cache, char op, mem_addr_t addr, unsigned int len);
+
+/*
+ * simulateRun - make the n accesses (ops[i], addrs[i], lens[i]) in order
+ */
+CSIM_INTERNAL void simulateRun(cache_t* cache, const char* ops, const mem_addr_t* addrs,
+                               const unsigned int* lens, int n)
+{
+#define SIMULATE(P) simulate_##P(cache, ops, addrs, lens, n)
+    switch(cache->policy) {
+    POLICY_CASES(SIMULATE);
+    }
+#undef SIMULATE
+}
+
+/*
+ * findLine - index of the line holding the block of addr, or -1
+ */
+static long findLine(const cache_t* cache, mem_addr_t addr)
+{
+    size_t s_bits = (addr >> cache->b) & (cache->S - 1);
+    mem_addr_t t_bits = addr >> (cache->s + cache->b);
+    size_t base = s_bits * cache->E;
+
+    for(int w = 0; w < cache->E; w += 64) {
+        uint64_t hit = probe(cache->tag + base + w, cache->E - w < 64 ? cache->E - w : 64, t_bits);
+        if(hit)
+            return base + w + __builtin_ctzll(hit);
+    }
+    return -1;
+}
+
+/*
+ * cacheLookup - look addr up without filling it on a miss; a hit
+ * updates the replacement state. Counts the hit or the miss.
+ */
+CSIM_INTERNAL bool cacheLookup(cache_t* cache, mem_addr_t addr)
+{
+    size_t s_bits = (addr >> cache->b) & (cache->S - 1);
+    mem_addr_t t_bits = addr >> (cache->s + cache->b);
+    int way = -1;
+
+#define LOOKUP(P) way = lookup_##P(cache, s_bits, t_bits)
+    switch(cache->policy) {
+    POLICY_CASES(LOOKUP);
+    }
+#undef LOOKUP
+    return way >= 0;
+}
+
+/*
+ * cacheInsert - fill the block of addr, which must not be cached yet,
+ * dirty or clean. Returns 0 if an open line took it, else 1 for a clean
+ * or 2 for a dirty eviction, with the victim's address in *victim.
+ */
+CSIM_INTERNAL int cacheInsert(cache_t* cache, mem_addr_t addr, bool dirty, mem_addr_t* victim)
+{
+    size_t s_bits = (addr >> cache->b) & (cache->S - 1);
+    mem_addr_t t_bits = addr >> (cache->s + cache->b);
+    mem_addr_t victim_tag = 0;
+    int evicted = 0;
+    int way = 0;
+
+#define INSERT(P) way = insert_##P(cache, s_bits, t_bits, &victim_tag, &evicted)
+    switch(cache->policy) {
+    POLICY_CASES(INSERT);
+    }
+#undef INSERT
+    cache->dirty[s_bits * cache->E + way] = dirty;
+    if(evicted)
+        *victim = (victim_tag << (cache->s + cache->b)) | (mem_addr_t)s_bits << cache->b;
+    return evicted;
+}
+
+/*
+ * cacheInvalidate - drop the block of addr if it is cached, leaving an
+ * open line. Returns 0 if it was not cached, 1 if it was clean and 2 if
+ * it was dirty; the caller owns any write back.
+ */
+CSIM_INTERNAL int cacheInvalidate(cache_t* cache, mem_addr_t addr)
+{
+    long line = findLine(cache, addr);
+    if(line < 0)
+        return 0;
+
+    int was = 1 + cache->dirty[line];
+    cache->tag[line] = TAG_INVALID;
+    cache->valid[line] = 0;
+    cache->dirty[line] = 0;
+    cache->prefetched[line] = 0;
+    cache->repl[line] = 0;
+    return was;
+}
+
+/*
+ * cacheMarkDirty - dirty the line holding the block of addr, if any.
+ * Returns true if the block was cached.
+ */
+CSIM_INTERNAL bool cacheMarkDirty(cache_t* cache, mem_addr_t addr)
+{
+    long line = findLine(cache, addr);
+    if(line >= 0)
+        cache->dirty[line] = 1;
+    return line >= 0;
+}
+
+/*
+ * cacheContains - true if the block of addr is cached; changes nothing
+ */
+CSIM_INTERNAL bool cacheContains(const cache_t* cache, mem_addr_t addr)
+{
+    return findLine(cache, addr) >= 0;
+}
+
+/* Type: Library handle
+ * What csim.h hands out: one cache and nothing else, so that no call
+ * through it touches a global but the tag probe, picked once
+ */
+struct csim {
+    cache_t cache;
+};
+
+_Static_assert(CSIM_WRITE_THROUGH == WRITE_THROUGH &&
+               CSIM_NO_WRITE_ALLOCATE == WRITE_NO_ALLOCATE,
+               "csim.h write flags must match write_mode_t");
+
+/*
+ * csim_create - see csim.h
+ */
+csim_t* csim_create(int s, int E, int b, const char* policy, int flags)
+{
+    policy_t p = POLICY_LRU;
+    if(policy)
+        for(p = 0; p < NUM_POLICIES; p++)
+            if(strcmp(policy, policy_names[p]) == 0)
+                break;
+    if(p == NUM_POLICIES || s < 0 || b < 0 || E < 1 || s + b < 1 || s + b > 63 ||
+       (flags & ~(CSIM_WRITE_THROUGH | CSIM_NO_WRITE_ALLOCATE | CSIM_SPLIT_LINES))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    csim_t* sim = malloc(sizeof(*sim));
+    if(!sim) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    int err = setupCache(&sim->cache, s, E, b, p,
+                         flags & (CSIM_WRITE_THROUGH | CSIM_NO_WRITE_ALLOCATE));
+    if(err) {
+        free(sim);
+        errno = err;
+        return NULL;
+    }
+    sim->cache.split_lines = flags & CSIM_SPLIT_LINES;
+    return sim;
+}
+
+/*
+ * csim_access - see csim.h
+ */
+int csim_access(csim_t* sim, char op, unsigned long long addr, unsigned int len)
+{
+    cache_t* cache = &sim->cache;
+    unsigned long long misses = cache->miss_count;
+    char load = 'L', store = 'S';
+
+    //a data modify is a load followed by a store to the same address
+    if(op == 'L' || op == 'M')
+        simulateRun(cache, &load, &addr, &len, 1);
+    if(op == 'S' || op == 'M')
+        simulateRun(cache, &store, &addr, &len, 1);
+    return cache->miss_count - misses;
+}
+
+/*
+ * csim_access_batch - see csim.h
+ */
+void csim_access_batch(csim_t* sim, const char* ops, const unsigned long long* addrs,
+                       const unsigned int* lens, size_t n)
+{
+    while(n) {
+        int m = n < INT_MAX ? (int)n : INT_MAX;
+        simulateRun(&sim->cache, ops, addrs, lens, m);
+        ops += m;
+        addrs += m;
+        lens += m;
+        n -= m;
+    }
+}
+
+/*
+ * csim_stats - see csim.h
+ */
+void csim_stats(const csim_t* sim, csim_stats_t* stats)
+{
+    const cache_t* cache = &sim->cache;
+    stats->hits = cache->hit_count;
+    stats->misses = cache->miss_count;
+    stats->evictions = cache->eviction_count;
+    stats->dirty_evictions = cache->dirty_eviction_count;
+    stats->write_bytes = cache->write_bytes;
+    stats->line_crossings = cache->line_crossing_count;
+}
+
+/*
+ * csim_destroy - see csim.h
+ */
+void csim_destroy(csim_t* sim)
+{
+    if(!sim)
+        return;
+    freeCache(&sim->cache);
+    free(sim);
+}
+
+/* Type: Prefetch engine
+ * Chosen with --prefetch; each watches the demand accesses of one cache
+ */
+typedef enum prefetch_kind {
+    PREFETCH_NONE,
+    PREFETCH_NEXT_LINE,     /* the blocks after a miss or a prefetch hit */
+    PREFETCH_STRIDE,        /* constant strides within a region */
+    PREFETCH_STREAM,        /* runs of misses to consecutive blocks */
+    NUM_PREFETCH_KINDS
+} prefetch_kind_t;
+
+/* Names accepted by --prefetch, indexed by prefetch_kind_t */
+CSIM_INTERNAL const char* prefetch_names[NUM_PREFETCH_KINDS] = {
+    "none", "next-line", "stride", "stream"
+};
+
+/* Stride table entries, and the log2 size of the region each one tracks */
+#define STRIDE_ENTRIES 256
+#define STRIDE_REGION_BITS 12
+
+/* Confirmations a stride needs before it is prefetched */
+#define STRIDE_CONFIDENT 2
+
+/* Stream trackers, and the most prefetches in flight at once */
+#define STREAMS 8
+#define PREFETCH_QUEUE 64
+
+/* Type: Stride table entry */
+typedef struct stride_entry {
+    mem_addr_t region;  /* region number + 1, 0 if unused */
+    mem_addr_t last;    /* last block accessed in the region */
+    long long stride;   /* in blocks */
+    int confidence;
+} stride_entry_t;
+
+/* Type: Stream tracker */
+typedef struct stream {
+    mem_addr_t last;    /* last missing block of the stream */
+    mem_addr_t ahead;   /* furthest block prefetched */
+    int dir;            /* +1 or -1 once confirmed, 0 before */
+    unsigned long long used; /* access clock at the last match, for LRU */
+} stream_t;
+
+/* Type: Prefetcher
+ * A prefetch is issued at some access and fills its block latency
+ * accesses later; until then it is in flight in queue[]. A demand miss on
+ * an in-flight block makes the prefetch late. The cache itself counts
+ * prefetched lines that are used (useful) or evicted unused (polluting).
+ */
+typedef struct prefetcher {
+    prefetch_kind_t kind;
+    int degree;             /* blocks prefetched per trigger */
+    int latency;            /* accesses until a prefetch fills */
+    unsigned long long now; /* demand accesses seen */
+
+    mem_addr_t queue[PREFETCH_QUEUE];
+    unsigned long long due[PREFETCH_QUEUE];
+    int queued;             /* in flight, oldest first */
+
+    stride_entry_t strides[STRIDE_ENTRIES];
+    stream_t streams[STREAMS];
+
+    /* Counters */
+    unsigned long long issued;      /* prefetches started */
+    unsigned long long redundant;   /* dropped: block cached or in flight already */
+    unsigned long long late;        /* demanded while still in flight */
+} prefetcher_t;
+
+/*
+ * initPrefetcher - set up an engine of kind that prefetches degree blocks
+ * per trigger, each filling latency accesses after it is issued
+ */
+CSIM_INTERNAL void initPrefetcher(prefetcher_t* pf, prefetch_kind_t kind, int degree, int latency)
+{
+    memset(pf, 0, sizeof(*pf));
+    pf->kind = kind;
+    pf->degree = degree;
+    pf->latency = latency;
+}
+
+/*
+ * inFlight - queue index of the prefetch of block, or -1
+ */
+static int inFlight(const prefetcher_t* pf, mem_addr_t block)
+{
+    for(int i = 0; i < pf->queued; i++)
+        if(pf->queue[i] == block)
+            return i;
+    return -1;
+}
+
+/*
+ * dequeuePrefetch - drop entry i of the in-flight queue
+ */
+static void dequeuePrefetch(prefetcher_t* pf, int i)
+{
+    pf->queued--;
+    memmove(pf->queue + i, pf->queue + i + 1, (pf->queued - i) * sizeof(mem_addr_t));
+    memmove(pf->due + i, pf->due + i + 1, (pf->queued - i) * sizeof(unsigned long long));
+}
+
+/*
+ * fillPrefetch - bring block into the cache as an unused prefetch
+ */
+static void fillPrefetch(cache_t* cache, mem_addr_t block)
+{
+    mem_addr_t addr = block << cache->b;
+    mem_addr_t victim;
+
+    if(cacheContains(cache, addr))
+        return;
+    cacheInsert(cache, addr, false, &victim);
+    cache->prefetched[findLine(cache, addr)] = 1;
+}
+
+/*
+ * retirePrefetches - fill every in-flight prefetch that is due
+ */
+static void retirePrefetches(prefetcher_t* pf, cache_t* cache)
+{
+    int done = 0;
+    while(done < pf->queued && pf->due[done] <= pf->now)
+        fillPrefetch(cache, pf->queue[done++]);
+    pf->queued -= done;
+    memmove(pf->queue, pf->queue + done, pf->queued * sizeof(mem_addr_t));
+    memmove(pf->due, pf->due + done, pf->queued * sizeof(unsigned long long));
+}
+
+/*
+ * issuePrefetch - start a prefetch of block unless it is pointless or
+ * the queue is full
+ */
+static void issuePrefetch(prefetcher_t* pf, cache_t* cache, mem_addr_t block)
+{
+    if(cacheContains(cache, block << cache->b) || inFlight(pf, block) >= 0) {
+        pf->redundant++;
+        return;
+    }
+    if(pf->queued == PREFETCH_QUEUE)
+        return;
+
+    pf->issued++;
+    if(pf->latency == 0) {
+        fillPrefetch(cache, block);
+        return;
+    }
+    pf->queue[pf->queued] = block;
+    pf->due[pf->queued++] = pf->now + pf->latency;
+}
+
+/*
+ * trainStride - per-region stride detection: once the same block stride
+ * repeats, prefetch degree strides ahead
+ */
+static void trainStride(prefetcher_t* pf, cache_t* cache, mem_addr_t addr)
+{
+    mem_addr_t block = addr >> cache->b;
+    mem_addr_t region = addr >> STRIDE_REGION_BITS;
+    stride_entry_t* e = &pf->strides[region % STRIDE_ENTRIES];
+
+    if(e->region != region + 1) {
+        e->region = region + 1;
+        e->last = block;
+        e->stride = 0;
+        e->confidence = 0;
+        return;
+    }
+
+    long long stride = (long long)(block - e->last);
+    if(stride == 0)
+        return;
+    if(stride == e->stride) {
+        if(e->confidence < STRIDE_CONFIDENT)
+            e->confidence++;
+    } else {
+        e->stride = stride;
+        e->confidence = 0;
+    }
+    e->last = block;
+
+    if(e->confidence >= STRIDE_CONFIDENT)
+        for(int k = 1; k <= pf->degree; k++)
+            issuePrefetch(pf, cache, block + k * stride);
+}
+
+/*
+ * trainStream - on a miss, extend the stream it continues by prefetching
+ * up to degree blocks ahead, or start a new stream in place of the least
+ * recently used one
+ */
+static void trainStream(prefetcher_t* pf, cache_t* cache, mem_addr_t block)
+{
+    stream_t* lru = &pf->streams[0];
+
+    for(int i = 0; i < STREAMS; i++) {
+        stream_t* st = &pf->streams[i];
+        if(st->used == 0 || st->used < lru->used)
+            lru = st;
+        if(st->used == 0)
+            continue;
+
+        //a confirmed stream matches anywhere up to its prefetch front
+        int dir = st->dir ? st->dir : block == st->last + 1 ? 1 : block == st->last - 1 ? -1 : 0;
+        bool match = st->dir ? (dir > 0 ? block > st->last && block <= st->ahead + 1
+                                        : block < st->last && block >= st->ahead - 1)
+                             : dir != 0;
+        if(!match)
+            continue;
+
+        st->dir = dir;
+        st->last = block;
+        st->used = pf->now;
+        if(dir > 0 ? st->ahead < block : st->ahead > block)
+            st->ahead = block;
+        while(dir > 0 ? st->ahead < block + pf->degree : st->ahead > block - pf->degree) {
+            st->ahead += dir;
+            issuePrefetch(pf, cache, st->ahead);
+        }
+        return;
+    }
+
+    lru->last = lru->ahead = block;
+    lru->dir = 0;
+    lru->used = pf->now;
+}
+
+/*
+ * accessPrefetched - make a demand access to a cache that has a
+ * prefetcher: fill the prefetches that are due, access the cache with
+ * access, then let the engine see the access and issue new prefetches
+ */
+static inline __attribute__((always_inline))
+void accessPrefetched(cache_t* cache, prefetcher_t* pf, access_fn access, char op,
+                      mem_addr_t addr, unsigned int len)
+{
+    pf->now++;
+    retirePrefetches(pf, cache);
+
+    mem_addr_t block = addr >> cache->b;
+    unsigned long long hits = cache->hit_count;
+    unsigned long long useful = cache->useful_prefetch_count;
+    access(cache, op, addr, len);
+    bool hit = cache->hit_count != hits;
+    bool prefetch_hit = cache->useful_prefetch_count != useful;
+
+    //the demand fetch overtook a prefetch still in flight
+    if(!hit) {
+        int i = inFlight(pf, block);
+        if(i >= 0) {
+            pf->late++;
+            dequeuePrefetch(pf, i);
+        }
+    }
+
+    switch(pf->kind) {
+    case PREFETCH_NEXT_LINE:
+        if(!hit || prefetch_hit)
+            for(int k = 1; k <= pf->degree; k++)
+                issuePrefetch(pf, cache, block + k);
+        break;
+    case PREFETCH_STRIDE:
+        trainStride(pf, cache, addr);
+        break;
+    case PREFETCH_STREAM:
+        if(!hit || prefetch_hit)
+            trainStream(pf, cache, block);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Type: TLB
+ * The translation lookaside buffers consulted before each data access,
+ * an L1 DTLB and optionally an STLB behind it. Each is a cache whose
+ * blocks are pages, so its hits and misses are its cache_t counters. A
+ * miss in the last one walks the page table, which reads walk_levels
+ * entries: 9 bits of a 48-bit virtual address per level above the page.
+ */
+#define MAX_TLB_LEVELS 2
+#define VA_BITS 48
+#define PT_LEVEL_BITS 9
+
+typedef struct tlb {
+    int nlevels;
+    cache_t levels[MAX_TLB_LEVELS];
+    int page_bits;
+    int walk_levels;
+    unsigned long long walks;
+    unsigned long long walk_refs; /* page table entries the walks read */
+} tlb_t;
+
+/*
+ * initTlb - attach to cache a TLB of nlevels levels with entries[i] entries
+ * of ways[i] ways each, for pages of 2^page_bits bytes, replacing by policy
+ */
+CSIM_INTERNAL void initTlb(tlb_t* t, cache_t* cache, int nlevels, const int* entries,
+                           const int* ways, int page_bits, policy_t policy)
+{
+    memset(t, 0, sizeof(*t));
+    t->nlevels = nlevels;
+    t->page_bits = page_bits;
+    t->walk_levels = page_bits < VA_BITS ?
+        (VA_BITS - page_bits + PT_LEVEL_BITS - 1) / PT_LEVEL_BITS : 1;
+    for(int i = 0; i < nlevels; i++)
+        initCache(&t->levels[i], __builtin_ctz(entries[i] / ways[i]), ways[i], page_bits,
+                  policy, 0);
+    cache->tlb = t;
+}
+
+/*
+ * freeTlb - free the levels initTlb() allocated
+ */
+CSIM_INTERNAL void freeTlb(tlb_t* t)
+{
+    for(int i = 0; i < t->nlevels; i++)
+        freeCache(&t->levels[i]);
+}
+
+/*
+ * accessTlb - translate addr, filling the levels that missed and walking
+ * the page table if all did
+ */
+CSIM_INTERNAL void accessTlb(tlb_t* t, mem_addr_t addr)
+{
+    mem_addr_t victim;
+    int hit = 0;
+    while(hit < t->nlevels && !cacheLookup(&t->levels[hit], addr))
+        hit++;
+    if(hit == t->nlevels) {
+        t->walks++;
+        t->walk_refs += t->walk_levels;
+    }
+    for(int i = hit - 1; i >= 0; i--)
+        cacheInsert(&t->levels[i], addr, false, &victim);
+}
+
+/* Type: Inclusion policy
+ * How a level of a hierarchy relates to the levels above it
+ */
+typedef enum inclusion {
+    INCLUSION_NINE,         /* neither inclusive nor exclusive */
+    INCLUSION_INCLUSIVE,    /* holds everything above; evictions back-invalidate */
+    INCLUSION_EXCLUSIVE,    /* holds only what the level above evicted */
+    NUM_INCLUSIONS
+} inclusion_t;
+
+/* Names accepted by --level, indexed by inclusion_t */
+CSIM_INTERNAL const char* inclusion_names[NUM_INCLUSIONS] = {
+    "nine", "inclusive", "exclusive"
+};
+
+/* Type: Cache level
+ * One level of a hierarchy, levels[0] being the L1. The inclusion policy
+ * of levels[0] is meaningless.
+ */
+typedef struct level {
+    cache_t cache;
+    inclusion_t inclusion;
+    unsigned long long back_invalidations; /* lines dropped because a lower level evicted them */
+    unsigned long long memory_write_bytes; /* written back past the last level */
+} level_t;
+
+/*
+ * writeBack - write the dirty block of addr, leaving level j, into the
+ * first level below that holds it; the bytes count against level j
+ * unless no level does and they go to memory
+ */
+CSIM_INTERNAL void writeBack(level_t* levels, int nlevels, int j, mem_addr_t addr)
+{
+    for(int k = j + 1; k < nlevels; k++)
+        if(cacheMarkDirty(&levels[k].cache, addr))
+            return;
+    levels[j].memory_write_bytes += (unsigned long long)1 << levels[j].cache.b;
+}
+
+/*
+ * fillLevel - fill the block of addr into level j, dirty or clean, and
+ * deal with what it evicts: an inclusive level removes the victim from
+ * every level above, an exclusive level below takes the victim in, and a
+ * dirty victim is written back otherwise
+ */
+CSIM_INTERNAL void fillLevel(level_t* levels, int nlevels, int j, mem_addr_t addr, bool dirty)
+{
+    mem_addr_t victim;
+
+    int evicted = cacheInsert(&levels[j].cache, addr, dirty, &victim);
+    if(!evicted)
+        return;
+    bool victim_dirty = evicted == 2;
+
+    //an upper copy may be newer; its data leaves with the victim
+    if(levels[j].inclusion == INCLUSION_INCLUSIVE)
+        for(int k = 0; k < j; k++) {
+            int was = cacheInvalidate(&levels[k].cache, victim);
+            if(was)
+                levels[k].back_invalidations++;
+            victim_dirty |= was == 2;
+        }
+
+    if(j + 1 < nlevels && levels[j + 1].inclusion == INCLUSION_EXCLUSIVE &&
+       !cacheContains(&levels[j + 1].cache, victim))
+        fillLevel(levels, nlevels, j + 1, victim, victim_dirty);
+    else if(victim_dirty)
+        writeBack(levels, nlevels, j, victim);
+}
+
+/*
+ * accessHierarchy - access addr through the levels in order until one
+ * hits, then fill it into the levels that missed. An exclusive level
+ * that hits gives the line up to the level above, and exclusive levels
+ * are only ever filled with victims from above. A store dirties the L1
+ * copy; the hierarchy is write-back and write-allocate throughout.
+ */
+CSIM_INTERNAL void accessHierarchy(level_t* levels, int nlevels, char op, mem_addr_t addr)
+{
+    int hit = 0;
+    bool dirty = false;
+    while(hit < nlevels && !cacheLookup(&levels[hit].cache, addr))
+        hit++;
+
+    if(hit < nlevels && hit > 0 && levels[hit].inclusion == INCLUSION_EXCLUSIVE)
+        dirty = cacheInvalidate(&levels[hit].cache, addr) == 2;
+
+    for(int j = hit - 1; j >= 0; j--)
+        if(j == 0 || levels[j].inclusion != INCLUSION_EXCLUSIVE)
+            fillLevel(levels, nlevels, j, addr, j == 0 && dirty);
+
+    if(op == 'S')
+        cacheMarkDirty(&levels[0].cache, addr);
+}
+
+/* Type: Latency model
+ * Cycle costs set with --latency, applied to the counters after a run:
+ *   hit[i]     every lookup in level i (the one cache of a single cache
+ *              or sweep is level 0)
+ *   memory     every miss in the last level
+ *   writeback  every write past the last level: a dirty block written
+ *              back, or a store sent on by write-through or no-write-allocate
+ *   walk       every page table entry a TLB miss reads
+ *   overlap    share of the memory latency a late prefetch still hides
+ * The stall cycles are those beyond a level 0 hit for every access.
+ */
+#define MAX_LATENCY_LEVELS 8
+
+typedef struct latency {
+    bool enabled;
+    int nhits;
+    double hit[MAX_LATENCY_LEVELS];
+    double memory;
+    double writeback;
+    double walk;
+    double overlap;
+} latency_t;
+
+CSIM_INTERNAL latency_t latency;
+
+typedef struct cost {
+    double cycles;
+    double stall_cycles;
+    double amat; /* cycles per access */
+} cost_t;
+
+/*
+ * finishCost - fill in the stall cycles and AMAT of cycles spent on
+ * accesses accesses
+ */
+static cost_t finishCost(double cycles, unsigned long long accesses)
+{
+    cost_t c = { cycles, cycles - accesses * latency.hit[0],
+                 accesses ? cycles / accesses : 0.0 };
+    return c;
+}
+
+/*
+ * cacheCost - the cycles a single cache spent by the latency table,
+ * with its TLB walks and late prefetches
+ */
+CSIM_INTERNAL cost_t cacheCost(const cache_t* c)
+{
+    unsigned long long accesses = c->hit_count + c->miss_count;
+    double misses = c->miss_count;
+    if(c->prefetcher)
+        misses -= latency.overlap * c->prefetcher->late;
+
+    double cycles = accesses * latency.hit[0] + misses * latency.memory +
+        (double)c->write_count * latency.writeback;
+    if(c->tlb)
+        cycles += c->tlb->walk_refs * latency.walk;
+    return finishCost(cycles, accesses);
+}
+
+/*
+ * hierarchyCost - the cycles a hierarchy spent by the latency table,
+ * each level charged for the lookups that reached it
+ */
+CSIM_INTERNAL cost_t hierarchyCost(const level_t* levels, int nlevels)
+{
+    const cache_t* last = &levels[nlevels - 1].cache;
+    double cycles = last->miss_count * latency.memory;
+    for(int i = 0; i < nlevels; i++) {
+        const cache_t* c = &levels[i].cache;
+        cycles += (c->hit_count + c->miss_count) * latency.hit[i] +
+            (double)(levels[i].memory_write_bytes >> c->b) * latency.writeback;
+    }
+    return finishCost(cycles, levels[0].cache.hit_count + levels[0].cache.miss_count);
+}
+
+/* Type: Stack distance set
+ * Mattson stack for one set. Every access of the set gets the next local
+ * time; live[t] marks the times that are still some block's most recent
+ * access and bit[] is a Fenwick tree over live[], so the stack distance
+ * of a reuse (distinct blocks touched since) is one prefix query.
+ * When the times run out the live marks are renumbered 1..nlive.
+ */
+typedef struct sd_set {
+    uint32_t* bit;      /* Fenwick tree over live[1..cap] */
+    char* live;
+    mem_addr_t* who;    /* block accessed at each time */
+    uint32_t cap;
+    uint32_t now;       /* last time handed out */
+    uint32_t nlive;     /* distinct blocks seen, i.e. live marks */
+} sd_set_t;
+
+/* Type: Stack distance engine
+ * Stack distances of every set of one (s, b) pair. hist[d] counts reuses
+ * at distance d < maxE, which hit in any LRU cache with more than d ways;
+ * far counts longer reuses and cold the first touch of each block.
+ * last maps each block to its most recent time, open addressed on
+ * block + 1 so that 0 marks an empty slot.
+ */
+typedef struct sd_engine {
+    int s;
+    int b;
+    int maxE;
+    size_t S;
+    sd_set_t* sets;
+    mem_addr_t* keys;
+    uint32_t* last;
+    size_t slots;       /* hash table size, a power of 2 */
+    size_t used;
+    unsigned long long* hist;
+    unsigned long long far;
+    unsigned long long cold;
+    unsigned long long accesses;
+} sd_engine_t;
+
+/* Distance sdAccess() returns for the first access of a block */
+#define SD_COLD UINT64_MAX
+
+/* Initial number of times per set and hash slots per engine */
+#define SD_SET_CAP 16
+#define SD_HASH_SLOTS 1024
+
+/*
+ * sdAlloc - calloc that exits on failure
+ */
+static void* sdAlloc(size_t n, size_t size)
+{
+    void* p = calloc(n, size);
+    if(!p) {
+        fprintf(stderr, "stack distance: %s\n", strerror(errno));
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * initStackDistance - set up an engine for 2^s sets of 2^b byte blocks
+ * whose curve covers 1..maxE ways
+ */
+CSIM_INTERNAL void initStackDistance(sd_engine_t* sd, int s, int b, int maxE)
+{
+    memset(sd, 0, sizeof(*sd));
+    sd->s = s;
+    sd->b = b;
+    sd->maxE = maxE;
+    sd->S = (size_t)1 << s;
+    sd->sets = sdAlloc(sd->S, sizeof(sd_set_t));
+    sd->slots = SD_HASH_SLOTS;
+    sd->keys = sdAlloc(sd->slots, sizeof(mem_addr_t));
+    sd->last = sdAlloc(sd->slots, sizeof(uint32_t));
+    sd->hist = sdAlloc(maxE, sizeof(unsigned long long));
+}
+
+/*
+ * freeStackDistance - free everything initStackDistance() and the
+ * replay allocated
+ */
+CSIM_INTERNAL void freeStackDistance(sd_engine_t* sd)
+{
+    for(size_t i = 0; i < sd->S; i++) {
+        free(sd->sets[i].bit);
+        free(sd->sets[i].live);
+        free(sd->sets[i].who);
+    }
+    free(sd->sets);
+    free(sd->keys);
+    free(sd->last);
+    free(sd->hist);
+}
+
+/*
+ * sdSlot - hash slot of block, either holding it or empty
+ */
+static inline size_t sdSlot(const sd_engine_t* sd, mem_addr_t block)
+{
+    size_t i = (block * 0x9e3779b97f4a7c15ULL) >> 20 & (sd->slots - 1);
+    while(sd->keys[i] && sd->keys[i] != block + 1)
+        i = (i + 1) & (sd->slots - 1);
+    return i;
+}
+
+/*
+ * sdGrowHash - double the block hash table
+ */
+static void sdGrowHash(sd_engine_t* sd)
+{
+    mem_addr_t* keys = sd->keys;
+    uint32_t* last = sd->last;
+    size_t slots = sd->slots;
+
+    sd->slots *= 2;
+    sd->keys = sdAlloc(sd->slots, sizeof(mem_addr_t));
+    sd->last = sdAlloc(sd->slots, sizeof(uint32_t));
+    for(size_t i = 0; i < slots; i++)
+        if(keys[i]) {
+            size_t j = sdSlot(sd, keys[i] - 1);
+            sd->keys[j] = keys[i];
+            sd->last[j] = last[i];
+        }
+    free(keys);
+    free(last);
+}
+
+/*
+ * sdRenumber - give the live marks of a set that has used up its times
+ * the times 1..nlive in order, doubling its capacity if that would still
+ * leave it more than half full, and rebuild its tree
+ */
+static void sdRenumber(sd_engine_t* sd, sd_set_t* set)
+{
+    uint32_t cap = set->cap;
+    uint32_t t = 0;
+
+    if(cap == 0 || set->nlive > cap / 2)
+        cap = cap ? cap * 2 : SD_SET_CAP;
+
+    char* live = sdAlloc(cap + 1, 1);
+    mem_addr_t* who = sdAlloc(cap + 1, sizeof(mem_addr_t));
+    for(uint32_t old = 1; old <= set->now; old++)
+        if(set->live[old]) {
+            t++;
+            live[t] = 1;
+            who[t] = set->who[old];
+            sd->last[sdSlot(sd, who[t])] = t;
+        }
+
+    //build the Fenwick tree in linear time
+    free(set->bit);
+    set->bit = sdAlloc(cap + 1, sizeof(uint32_t));
+    for(uint32_t i = 1; i <= cap; i++) {
+        set->bit[i] += live[i];
+        uint32_t up = i + (i & -i);
+        if(up <= cap)
+            set->bit[up] += set->bit[i];
+    }
+
+    free(set->live);
+    free(set->who);
+    set->live = live;
+    set->who = who;
+    set->cap = cap;
+    set->now = t;
+}
+
+/*
+ * sdAccess - record an access to addr: find its stack distance within its
+ * set and make it the most recent access of its block. Returns the
+ * distance, or SD_COLD if the block was never accessed before.
+ */
+CSIM_INTERNAL uint64_t sdAccess(sd_engine_t* sd, mem_addr_t addr)
+{
+    mem_addr_t block = addr >> sd->b;
+    sd_set_t* set = &sd->sets[block & (sd->S - 1)];
+
+    sd->accesses++;
+    if(set->now == set->cap)
+        sdRenumber(sd, set);
+    uint32_t now = ++set->now;
+
+    size_t slot = sdSlot(sd, block);
+    uint64_t d = SD_COLD;
+    if(sd->keys[slot]) {
+        //distance = live marks after the previous access of this block
+        uint32_t prev = sd->last[slot];
+        uint64_t before = 0;
+        for(uint32_t i = prev; i > 0; i -= i & -i)
+            before += set->bit[i];
+        d = set->nlive - before;
+        if(d < (uint64_t)sd->maxE)
+            sd->hist[d]++;
+        else
+            sd->far++;
+
+        set->live[prev] = 0;
+        for(uint32_t i = prev; i <= set->cap; i += i & -i)
+            set->bit[i]--;
+    } else {
+        sd->cold++;
+        set->nlive++;
+        sd->keys[slot] = block + 1;
+        if(++sd->used * 2 > sd->slots) {
+            sdGrowHash(sd);
+            slot = sdSlot(sd, block);
+        }
+    }
+
+    sd->last[slot] = now;
+    set->live[now] = 1;
+    set->who[now] = block;
+    for(uint32_t i = now; i <= set->cap; i += i & -i)
+        set->bit[i]++;
+    return d;
+}
+
+/*
+ * sdCurve - the misses and evictions an LRU cache of E <= maxE ways would
+ * have seen
+ */
+CSIM_INTERNAL void sdCurve(const sd_engine_t* sd, int E, unsigned long long* misses,
+                           unsigned long long* evictions)
+{
+    //reuses at distances below E are the hits of E ways
+    *misses = sd->accesses;
+    for(int d = 0; d < E; d++)
+        *misses -= sd->hist[d];
+
+    //every miss evicts, except the ones filling a still empty way
+    unsigned long long fills = 0;
+    for(size_t i = 0; i < sd->S; i++)
+        fills += sd->sets[i].nlive < (uint32_t)E ? sd->sets[i].nlive : (uint32_t)E;
+    *evictions = *misses - fills;
+}
+
+/*
+ * printStackDistance - print the hits, misses and evictions an LRU cache
+ * of every associativity 1..maxE would have seen
+ */
+CSIM_INTERNAL void printStackDistance(const sd_engine_t* sd)
+{
+    for(int E = 1; E <= sd->maxE; E++) {
+        unsigned long long misses, evictions;
+        sdCurve(sd, E, &misses, &evictions);
+        printf("s:%d E:%d b:%d hits:%llu misses:%llu evictions:%llu\n",
+               sd->s, E, sd->b, sd->accesses - misses, misses, evictions);
+    }
+}
+
+/* Type: Coherence protocol
+ * Chosen with --coherence; MOESI adds the owned state, so a dirty line
+ * can be shared without writing it back first
+ */
+typedef enum protocol {
+    PROTOCOL_MESI,
+    PROTOCOL_MOESI,
+    NUM_PROTOCOLS
+} protocol_t;
+
+/* Names accepted by --coherence, indexed by protocol_t */
+CSIM_INTERNAL const char* protocol_names[NUM_PROTOCOLS] = { "mesi", "moesi" };
+
+/* States of a line of a private cache; 0 is invalid */
+typedef enum line_state {
+    STATE_I,
+    STATE_S,
+    STATE_E,
+    STATE_O,
+    STATE_M
+} line_state_t;
+
+/* Type: Block map
+ * An open addressing table of blocks, keyed by block + 1 (0 is empty).
+ * A core's map holds the blocks other cores invalidated in it; while
+ * lost, written collects the bytes the other cores have stored to since,
+ * one bit per 1/64 of the block. The shared map counts the false sharing
+ * misses of each block.
+ */
+typedef struct block_entry {
+    mem_addr_t key;
+    uint64_t written;
+    bool lost;
+    unsigned long long false_sharing;
+} block_entry_t;
+
+typedef struct block_map {
+    block_entry_t* slots;
+    size_t nslots; /* a power of 2 */
+    size_t n;
+} block_map_t;
+
+/* Type: Core
+ * A private cache kept coherent with the other cores' by snooping, with
+ * the protocol state of each of its lines beside it
+ */
+typedef struct core {
+    cache_t cache;
+    char* state;     /* line_state_t of each line, indexed like cache.tag */
+    block_map_t lost;
+    unsigned long long coherence_misses;     /* misses on blocks another core invalidated */
+    unsigned long long false_sharing_misses; /* ... that touched none of its writes */
+    unsigned long long invalidations;        /* lines another core invalidated here */
+    unsigned long long upgrades;             /* stores to shared lines */
+    unsigned long long transfers;            /* dirty lines supplied to another core */
+    unsigned long long writebacks;           /* dirty lines written to memory */
+} core_t;
+
+/*
+ * initBlockMap - an empty block map
+ */
+static void initBlockMap(block_map_t* m)
+{
+    m->nslots = SD_HASH_SLOTS;
+    m->slots = sdAlloc(m->nslots, sizeof(block_entry_t));
+    m->n = 0;
+}
+
+/*
+ * findBlock - the entry of block, or NULL if there is none and !add
+ */
+static block_entry_t* findBlock(block_map_t* m, mem_addr_t block, bool add)
+{
+    size_t i = (block * 0x9e3779b97f4a7c15ULL) >> 20 & (m->nslots - 1);
+    while(m->slots[i].key && m->slots[i].key != block + 1)
+        i = (i + 1) & (m->nslots - 1);
+    if(m->slots[i].key || !add)
+        return m->slots[i].key ? &m->slots[i] : NULL;
+
+    //keep the table at most half full
+    if((m->n + 1) * 2 > m->nslots) {
+        block_entry_t* old = m->slots;
+        size_t nslots = m->nslots;
+        m->nslots *= 2;
+        m->slots = sdAlloc(m->nslots, sizeof(block_entry_t));
+        for(size_t j = 0; j < nslots; j++)
+            if(old[j].key) {
+                i = ((old[j].key - 1) * 0x9e3779b97f4a7c15ULL) >> 20 & (m->nslots - 1);
+                while(m->slots[i].key)
+                    i = (i + 1) & (m->nslots - 1);
+                m->slots[i] = old[j];
+            }
+        free(old);
+        i = (block * 0x9e3779b97f4a7c15ULL) >> 20 & (m->nslots - 1);
+        while(m->slots[i].key)
+            i = (i + 1) & (m->nslots - 1);
+    }
+    m->n++;
+    m->slots[i].key = block + 1;
+    return &m->slots[i];
+}
+
+/*
+ * initCores - set up ncores private caches of 2^s sets of E lines of 2^b
+ * bytes replacing by policy, and the shared false sharing map
+ */
+CSIM_INTERNAL void initCores(core_t* cores, int ncores, int s, int E, int b, policy_t policy,
+                             block_map_t* shared)
+{
+    for(int i = 0; i < ncores; i++) {
+        memset(&cores[i], 0, sizeof(core_t));
+        initCache(&cores[i].cache, s, E, b, policy, 0);
+        cores[i].state = sdAlloc(cores[i].cache.S * E, 1);
+        initBlockMap(&cores[i].lost);
+    }
+    initBlockMap(shared);
+}
+
+/*
+ * freeCores - free what initCores() and the replay allocated
+ */
+CSIM_INTERNAL void freeCores(core_t* cores, int ncores, block_map_t* shared)
+{
+    for(int i = 0; i < ncores; i++) {
+        freeCache(&cores[i].cache);
+        free(cores[i].state);
+        free(cores[i].lost.slots);
+    }
+    free(shared->slots);
+}
+
+/*
+ * byteMask - the 1/64ths of its block that len bytes at addr cover; the
+ * access must not cross the block
+ */
+static inline uint64_t byteMask(mem_addr_t addr, unsigned int len, int b)
+{
+    int shift = b > 6 ? b - 6 : 0;
+    mem_addr_t offset = addr & (((mem_addr_t)1 << b) - 1);
+    int first = offset >> shift;
+    int last = (offset + (len ? len : 1) - 1) >> shift;
+    if(last > (1 << (b - shift)) - 1)
+        last = (1 << (b - shift)) - 1;
+    return (last - first == 63 ? ~0ULL : ((1ULL << (last - first + 1)) - 1)) << first;
+}
+
+/*
+ * missCoherent - classify the miss of core c on the block of addr: a
+ * coherence miss if another core invalidated the block here, and false
+ * sharing if none of the bytes they stored since are among those touched
+ */
+static void missCoherent(core_t* cores, int c, mem_addr_t addr, uint64_t mask, block_map_t* shared)
+{
+    core_t* core = &cores[c];
+    block_entry_t* e = findBlock(&core->lost, addr >> core->cache.b, false);
+    if(!e || !e->lost)
+        return;
+    e->lost = false;
+    core->coherence_misses++;
+    if(!(e->written & mask)) {
+        core->false_sharing_misses++;
+        findBlock(shared, addr >> core->cache.b, true)->false_sharing++;
+    }
+}
+
+/*
+ * invalidateOthers - take the block of addr away from every core but c,
+ * for a store by c; on a read for ownership (rfo) one that held it dirty
+ * forwards the data, while an upgrade already has it
+ */
+static void invalidateOthers(core_t* cores, int ncores, int c, mem_addr_t addr, bool rfo)
+{
+    for(int k = 0; k < ncores; k++) {
+        long line = k == c ? -1 : findLine(&cores[k].cache, addr);
+        if(line < 0)
+            continue;
+        if(rfo && (cores[k].state[line] == STATE_M || cores[k].state[line] == STATE_O))
+            cores[k].transfers++;
+        cores[k].state[line] = STATE_I;
+        cacheInvalidate(&cores[k].cache, addr);
+        cores[k].invalidations++;
+        block_entry_t* e = findBlock(&cores[k].lost, addr >> cores[k].cache.b, true);
+        e->lost = true;
+        e->written = 0;
+    }
+}
+
+/*
+ * shareOthers - let every core but c that holds the block of addr keep a
+ * shared copy, for a load miss by c; returns true if any holds one
+ */
+static bool shareOthers(core_t* cores, int ncores, int c, mem_addr_t addr, protocol_t protocol)
+{
+    bool shared = false;
+    for(int k = 0; k < ncores; k++) {
+        long line = k == c ? -1 : findLine(&cores[k].cache, addr);
+        if(line < 0)
+            continue;
+        shared = true;
+        char* st = &cores[k].state[line];
+        if(*st == STATE_M || *st == STATE_O)
+            cores[k].transfers++;
+        //MESI writes a modified line back before sharing it, MOESI owns it
+        if(*st == STATE_M && protocol == PROTOCOL_MESI) {
+            cores[k].writebacks++;
+            cores[k].cache.write_count++;
+            cores[k].cache.write_bytes += (unsigned long long)1 << cores[k].cache.b;
+            cores[k].cache.dirty[line] = 0;
+            *st = STATE_S;
+        } else if(*st == STATE_M) {
+            *st = STATE_O;
+        } else if(*st == STATE_E) {
+            *st = STATE_S;
+        }
+    }
+    return shared;
+}
+
+/*
+ * fillCoherent - fill the block of addr into core in state st
+ */
+static void fillCoherent(core_t* core, mem_addr_t addr, line_state_t st)
+{
+    mem_addr_t victim;
+    if(cacheInsert(&core->cache, addr, st == STATE_M, &victim) == 2)
+        core->writebacks++;
+    core->state[findLine(&core->cache, addr)] = st;
+}
+
+/*
+ * accessCoherent - an access by core c of len bytes at addr, all in one
+ * block, kept coherent with the other cores by protocol
+ */
+CSIM_INTERNAL void accessCoherent(core_t* cores, int ncores, int c, char op, mem_addr_t addr,
+                                  unsigned int len, protocol_t protocol, block_map_t* shared)
+{
+    core_t* core = &cores[c];
+    long line = findLine(&core->cache, addr);
+    line_state_t st = line >= 0 ? core->state[line] : STATE_I;
+    uint64_t mask = byteMask(addr, len, core->cache.b);
+
+    //count the hit or miss and update the replacement state
+    cacheLookup(&core->cache, addr);
+    if(st == STATE_I)
+        missCoherent(cores, c, addr, mask, shared);
+
+    if(op != 'S') {
+        if(st == STATE_I)
+            fillCoherent(core, addr, shareOthers(cores, ncores, c, addr, protocol) ?
+                         STATE_S : STATE_E);
+        return;
+    }
+
+    if(st == STATE_I) {
+        //a read for ownership
+        invalidateOthers(cores, ncores, c, addr, true);
+        fillCoherent(core, addr, STATE_M);
+    } else {
+        if(st == STATE_S || st == STATE_O) {
+            core->upgrades++;
+            invalidateOthers(cores, ncores, c, addr, false);
+        }
+        core->state[line] = STATE_M;
+        core->cache.dirty[line] = 1;
+    }
+
+    //the other cores that lost the block now cannot reuse these bytes
+    for(int k = 0; k < ncores; k++) {
+        block_entry_t* e = k == c ? NULL : findBlock(&cores[k].lost, addr >> core->cache.b, false);
+        if(e && e->lost)
+            e->written |= mask;
+    }
+}
+
+/* Type: Address ranges
+ * Named ranges of the address space loaded by --ranges, for --detail to
+ * charge accesses to: data symbols, one per line as nm -S prints them,
+ *   0000000000004040 00000000005b8d80 B arr2D
+ * or allocations logged as "<start> <size> <name>", e.g. with a call site
+ * for the name. Numbers are hex, with or without 0x; a lone letter where
+ * the size goes is the type of a symbol nm knows no size of, so such lines
+ * are skipped and sizes a-f must be written 0xa-0xf. Only a line whose
+ * size is as wide as its address, as nm pads both, has a type letter
+ * before the name. ranges[] is sorted by start; ranges[nranges] holds the
+ * accesses that fall in none. Ranges may nest or overlap, as symbols
+ * inside a section do; an access is charged to the range holding it that
+ * starts closest below it.
+ * Each cache's copy counts the hits and misses of every range, how often
+ * its blocks were evicted, and, for each pair of ranges, how often a
+ * miss in the first evicted a block of the second.
+ */
+typedef struct range {
+    mem_addr_t start;
+    mem_addr_t end; /* one past the last byte */
+    char* name;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evicted; /* blocks of the range evicted */
+    size_t outer; /* closest earlier range holding start, or nranges */
+} range_t;
+
+typedef struct conflict {
+    uint32_t evictor; /* range of the miss */
+    uint32_t victim;  /* range of the block it evicted */
+    unsigned long long count;
+} conflict_t;
+
+typedef struct range_map {
+    range_t* ranges;
+    size_t nranges;
+    mem_addr_t* conflict_keys;  /* (evictor << 32 | victim) + 1, 0 for empty */
+    uint32_t* conflict_index;   /* index of the slot's pair in conflicts[] */
+    size_t conflict_slots;      /* a power of 2 */
+    conflict_t* conflicts;
+    size_t nconflicts;
+    mem_addr_t* set_tags;       /* the accessed set before the access */
+} range_map_t;
+
+/*
+ * compareRanges - qsort() order of ranges by start
+ */
+static int compareRanges(const void* a, const void* b)
+{
+    mem_addr_t x = ((const range_t*)a)->start, y = ((const range_t*)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * isTypeField - true if p starts with a lone nm symbol type letter
+ * followed by a name
+ */
+static bool isTypeField(const char* p)
+{
+    return ((p[0] | 0x20) >= 'a' && (p[0] | 0x20) <= 'z') && (p[1] == ' ' || p[1] == '\t') &&
+        p[1 + strspn(p + 1, " \t")];
+}
+
+/*
+ * loadRanges - read the ranges of map_fn into map, moved up by offset
+ * (the load address of a position independent executable); lines that
+ * are not ranges of at least one byte, such as undefined symbols, are
+ * skipped
+ */
+CSIM_INTERNAL void loadRanges(range_map_t* map, const char* map_fn, mem_addr_t offset)
+{
+    FILE* fp = fopen(map_fn, "r");
+    if(!fp) {
+        fprintf(stderr, "%s: %s\n", map_fn, strerror(errno));
+        exit(1);
+    }
+    memset(map, 0, sizeof(*map));
+
+    char line[1024];
+    size_t cap = 0;
+    while(fgets(line, sizeof(line), fp)) {
+        char* p = line;
+        char* end;
+        line[strcspn(line, "\n")] = '\0';
+        mem_addr_t start = strtoull(p, &end, 16);
+        if(end == p || (*end != ' ' && *end != '\t'))
+            continue;
+        size_t addr_width = end - p;
+        p = end + strspn(end, " \t");
+
+        //a symbol nm knows no size of has its type letter in the size column
+        if(isTypeField(p))
+            continue;
+        mem_addr_t size = strtoull(p, &end, 16);
+        if(end == p || (*end != ' ' && *end != '\t') || size == 0)
+            continue;
+        bool nm_line = (size_t)(end - p) == addr_width;
+        p = end + strspn(end, " \t");
+
+        //nm puts a one letter symbol type before the name
+        if(nm_line && isTypeField(p))
+            p += 1 + strspn(p + 1, " \t");
+        if(!*p)
+            continue;
+
+        if(map->nranges + 1 >= cap) {
+            cap = cap ? cap * 2 : 64;
+            map->ranges = realloc(map->ranges, cap * sizeof(range_t));
+            if(!map->ranges) {
+                fprintf(stderr, "loadRanges: %s\n", strerror(errno));
+                exit(1);
+            }
+        }
+        map->ranges[map->nranges++] = (range_t){ start + offset, start + offset + size,
+                                                 strdup(p), 0, 0, 0, 0 };
+    }
+    fclose(fp);
+    if(map->nranges == 0) {
+        fprintf(stderr, "%s: no address ranges\n", map_fn);
+        exit(1);
+    }
+    if(map->nranges > UINT32_MAX) {
+        fprintf(stderr, "%s: too many address ranges\n", map_fn);
+        exit(1);
+    }
+
+    qsort(map->ranges, map->nranges, sizeof(range_t), compareRanges);
+    map->ranges[map->nranges] = (range_t){ 0, 0, "[unmapped]", 0, 0, 0, map->nranges };
+
+    //the ranges still open at a start are a stack, innermost on top
+    size_t* open = sdAlloc(map->nranges, sizeof(size_t));
+    size_t nopen = 0;
+    for(size_t i = 0; i < map->nranges; i++) {
+        while(nopen && map->ranges[open[nopen - 1]].end <= map->ranges[i].start)
+            nopen--;
+        map->ranges[i].outer = nopen ? open[nopen - 1] : map->nranges;
+        open[nopen++] = i;
+    }
+    free(open);
+}
+
+/*
+ * unloadRanges - free what loadRanges() allocated
+ */
+CSIM_INTERNAL void unloadRanges(range_map_t* map)
+{
+    for(size_t i = 0; i < map->nranges; i++)
+        free(map->ranges[i].name);
+    free(map->ranges);
+}
+
+/*
+ * initRanges - give cache its own zeroed copy of the ranges of proto;
+ * the names stay shared
+ */
+CSIM_INTERNAL void initRanges(range_map_t* map, const range_map_t* proto, cache_t* cache)
+{
+    memset(map, 0, sizeof(*map));
+    map->nranges = proto->nranges;
+    map->ranges = sdAlloc(proto->nranges + 1, sizeof(range_t));
+    memcpy(map->ranges, proto->ranges, (proto->nranges + 1) * sizeof(range_t));
+    map->conflict_slots = SD_HASH_SLOTS;
+    map->conflict_keys = sdAlloc(map->conflict_slots, sizeof(mem_addr_t));
+    map->conflict_index = sdAlloc(map->conflict_slots, sizeof(uint32_t));
+    map->set_tags = sdAlloc(cache->E, sizeof(mem_addr_t));
+}
+
+/*
+ * freeRanges - free what initRanges() and the replay allocated
+ */
+CSIM_INTERNAL void freeRanges(range_map_t* map)
+{
+    free(map->ranges);
+    free(map->conflict_keys);
+    free(map->conflict_index);
+    free(map->conflicts);
+    free(map->set_tags);
+}
+
+/*
+ * findRange - index of the range holding addr that starts closest below
+ * it: the last one starting at or below it, or else the closest range
+ * enclosing that one's start which still holds addr; nranges if none does
+ */
+static size_t findRange(const range_map_t* map, mem_addr_t addr)
+{
+    size_t lo = 0, hi = map->nranges;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(map->ranges[mid].start <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == 0)
+        return map->nranges;
+    size_t i = lo - 1;
+    while(i < map->nranges && addr >= map->ranges[i].end)
+        i = map->ranges[i].outer;
+    return i;
+}
+
+/*
+ * conflictSlot - hash slot of key, either holding it or empty
+ */
+static inline size_t conflictSlot(const range_map_t* map, mem_addr_t key)
+{
+    size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 20 & (map->conflict_slots - 1);
+    while(map->conflict_keys[i] && map->conflict_keys[i] != key + 1)
+        i = (i + 1) & (map->conflict_slots - 1);
+    return i;
+}
+
+/*
+ * recordConflict - count one eviction of a block of range victim by a
+ * miss in range evictor
+ */
+static void recordConflict(range_map_t* map, uint32_t evictor, uint32_t victim)
+{
+    mem_addr_t key = (mem_addr_t)evictor << 32 | victim;
+    size_t slot = conflictSlot(map, key);
+    map->ranges[victim].evicted++;
+    if(map->conflict_keys[slot]) {
+        map->conflicts[map->conflict_index[slot]].count++;
+        return;
+    }
+
+    //conflicts[] doubles when full, the hash table when half full
+    if((map->nconflicts & (map->nconflicts - 1)) == 0) {
+        size_t cap = map->nconflicts ? map->nconflicts * 2 : 1;
+        conflict_t* conflicts = realloc(map->conflicts, cap * sizeof(conflict_t));
+        if(!conflicts) {
+            fprintf(stderr, "ranges: %s\n", strerror(errno));
+            exit(1);
+        }
+        map->conflicts = conflicts;
+    }
+    if((map->nconflicts + 1) * 2 > map->conflict_slots) {
+        mem_addr_t* keys = map->conflict_keys;
+        uint32_t* index = map->conflict_index;
+        size_t slots = map->conflict_slots;
+        map->conflict_slots *= 2;
+        map->conflict_keys = sdAlloc(map->conflict_slots, sizeof(mem_addr_t));
+        map->conflict_index = sdAlloc(map->conflict_slots, sizeof(uint32_t));
+        for(size_t i = 0; i < slots; i++)
+            if(keys[i]) {
+                size_t j = conflictSlot(map, keys[i] - 1);
+                map->conflict_keys[j] = keys[i];
+                map->conflict_index[j] = index[i];
+            }
+        free(keys);
+        free(index);
+        slot = conflictSlot(map, key);
+    }
+
+    map->conflict_keys[slot] = key + 1;
+    map->conflict_index[slot] = map->nconflicts;
+    map->conflicts[map->nconflicts++] = (conflict_t){ evictor, victim, 1 };
+}
+
+/* Type: Detailed statistics
+ * Breakdown of the accesses of one cache, collected with --detail:
+ * hits and misses per set, per 2^region_bits byte region of the address
+ * space, and every miss classified as
+ *   cold      first access of the block
+ *   capacity  would miss in a fully associative LRU cache of the same
+ *             size as well
+ *   conflict  would hit there, so is down to the mapping or the policy
+ * shadow is that fully associative cache, a single set stack distance
+ * engine: the reuse distance tells whether it would hit.
+ */
+typedef struct region_stats {
+    mem_addr_t region; /* address >> region_bits */
+    unsigned long long hits;
+    unsigned long long misses;
+} region_stats_t;
+
+typedef struct detail {
+    unsigned long long* set_hits;
+    unsigned long long* set_misses;
+    sd_engine_t shadow;
+    uint64_t lines; /* S * E, the size of shadow */
+    unsigned long long cold_misses;
+    unsigned long long capacity_misses;
+    unsigned long long conflict_misses;
+
+    int region_bits;
+    mem_addr_t* region_keys;    /* region + 1, 0 for an empty slot */
+    uint32_t* region_index;     /* index of the slot's region in regions[] */
+    size_t region_slots;        /* a power of 2 */
+    region_stats_t* regions;
+    size_t nregions;
+
+    range_map_t* ranges; /* NULL unless --ranges */
+} detail_t;
+
+/* Default number of bits of a --detail region */
+#define DETAIL_REGION_BITS 12
+
+/*
+ * initDetail - set up the breakdown of cache and attach it, with a copy
+ * of ranges unless that is NULL
+ */
+CSIM_INTERNAL void initDetail(detail_t* d, cache_t* cache, int region_bits,
+                              const range_map_t* ranges)
+{
+    memset(d, 0, sizeof(*d));
+    d->set_hits = sdAlloc(cache->S, sizeof(unsigned long long));
+    d->set_misses = sdAlloc(cache->S, sizeof(unsigned long long));
+    //the shadow only needs the distances, not a miss curve
+    initStackDistance(&d->shadow, 0, cache->b, 1);
+    d->lines = (uint64_t)cache->S * cache->E;
+    d->region_bits = region_bits;
+    d->region_slots = SD_HASH_SLOTS;
+    d->region_keys = sdAlloc(d->region_slots, sizeof(mem_addr_t));
+    d->region_index = sdAlloc(d->region_slots, sizeof(uint32_t));
+    if(ranges) {
+        d->ranges = sdAlloc(1, sizeof(range_map_t));
+        initRanges(d->ranges, ranges, cache);
+    }
+    cache->detail = d;
+}
+
+/*
+ * freeDetail - free everything initDetail() and the replay allocated
+ */
+CSIM_INTERNAL void freeDetail(detail_t* d)
+{
+    free(d->set_hits);
+    free(d->set_misses);
+    freeStackDistance(&d->shadow);
+    free(d->region_keys);
+    free(d->region_index);
+    free(d->regions);
+    if(d->ranges) {
+        freeRanges(d->ranges);
+        free(d->ranges);
+    }
+}
+
+/*
+ * regionSlot - hash slot of region, either holding it or empty
+ */
+static inline size_t regionSlot(const detail_t* d, mem_addr_t region)
+{
+    size_t i = (region * 0x9e3779b97f4a7c15ULL) >> 20 & (d->region_slots - 1);
+    while(d->region_keys[i] && d->region_keys[i] != region + 1)
+        i = (i + 1) & (d->region_slots - 1);
+    return i;
+}
+
+/*
+ * findRegion - statistics of the region addr falls in, added if new
+ */
+static region_stats_t* findRegion(detail_t* d, mem_addr_t addr)
+{
+    mem_addr_t region = addr >> d->region_bits;
+    size_t slot = regionSlot(d, region);
+    if(d->region_keys[slot])
+        return &d->regions[d->region_index[slot]];
+
+    //regions[] doubles when full, the hash table when half full
+    if((d->nregions & (d->nregions - 1)) == 0) {
+        size_t cap = d->nregions ? d->nregions * 2 : 1;
+        region_stats_t* regions = realloc(d->regions, cap * sizeof(region_stats_t));
+        if(!regions) {
+            fprintf(stderr, "detail: %s\n", strerror(errno));
+            exit(1);
+        }
+        d->regions = regions;
+    }
+    if((d->nregions + 1) * 2 > d->region_slots) {
+        mem_addr_t* keys = d->region_keys;
+        uint32_t* index = d->region_index;
+        size_t slots = d->region_slots;
+        d->region_slots *= 2;
+        d->region_keys = sdAlloc(d->region_slots, sizeof(mem_addr_t));
+        d->region_index = sdAlloc(d->region_slots, sizeof(uint32_t));
+        for(size_t i = 0; i < slots; i++)
+            if(keys[i]) {
+                size_t j = regionSlot(d, keys[i] - 1);
+                d->region_keys[j] = keys[i];
+                d->region_index[j] = index[i];
+            }
+        free(keys);
+        free(index);
+        slot = regionSlot(d, region);
+    }
+
+    d->region_keys[slot] = region + 1;
+    d->region_index[slot] = d->nregions;
+    d->regions[d->nregions] = (region_stats_t){ region, 0, 0 };
+    return &d->regions[d->nregions++];
+}
+
+/*
+ * recordRange - charge an access to addr that hit or missed in cache to
+ * its range, and every block the access evicted from the set, which
+ * held set_tags before it, to the pair of ranges
+ */
+static void recordRange(cache_t* cache, range_map_t* map, mem_addr_t addr, bool hit)
+{
+    size_t i = findRange(map, addr);
+    if(hit) {
+        map->ranges[i].hits++;
+        return;
+    }
+    map->ranges[i].misses++;
+
+    size_t set = (addr >> cache->b) & (cache->S - 1);
+    const mem_addr_t* tags = cache->tag + set * cache->E;
+    for(int w = 0; w < cache->E; w++)
+        if(map->set_tags[w] != TAG_INVALID && map->set_tags[w] != tags[w]) {
+            mem_addr_t victim = map->set_tags[w] << (cache->s + cache->b) | set << cache->b;
+            recordConflict(map, i, findRange(map, victim));
+        }
+}
+
+/*
+ * recordDetail - add an access to addr that hit or missed in cache to the
+ * breakdown
+ */
+CSIM_INTERNAL void recordDetail(cache_t* cache, mem_addr_t addr, bool hit)
+{
+    detail_t* d = cache->detail;
+    size_t set = (addr >> cache->b) & (cache->S - 1);
+    region_stats_t* r = findRegion(d, addr);
+    uint64_t distance = sdAccess(&d->shadow, addr);
+
+    if(d->ranges)
+        recordRange(cache, d->ranges, addr, hit);
+    if(hit) {
+        d->set_hits[set]++;
+        r->hits++;
+        return;
+    }
+    d->set_misses[set]++;
+    r->misses++;
+    if(distance == SD_COLD)
+        d->cold_misses++;
+    else if(distance >= d->lines)
+        d->capacity_misses++;
+    else
+        d->conflict_misses++;
+}
+
+/*
+ * accessObserved - access() for a cache with a prefetcher, a breakdown
+ * or a TLB attached
+ */
+static inline __attribute__((always_inline))
+void accessObserved(cache_t* cache, access_fn access, char op, mem_addr_t addr, unsigned int len)
+{
+    unsigned long long hits = cache->hit_count;
+
+    if(cache->tlb)
+        accessTlb(cache->tlb, addr);
+
+    //the set as it was, to tell which of its blocks a miss evicts
+    if(cache->detail && cache->detail->ranges)
+        memcpy(cache->detail->ranges->set_tags,
+               cache->tag + ((addr >> cache->b) & (cache->S - 1)) * cache->E,
+               cache->E * sizeof(mem_addr_t));
+
+    if(cache->prefetcher)
+        accessPrefetched(cache, cache->prefetcher, access, op, addr, len);
+    else
+        access(cache, op, addr, len);
+    if(cache->detail)
+        recordDetail(cache, addr, cache->hit_count != hits);
+}
+
+/*
+ * observeRun - the n accesses through accessObserved(), inlined for one
+ * policy's access
+ */
+static inline __attribute__((always_inline))
+void observeRun(cache_t* cache, access_fn access, const char* ops, const mem_addr_t* addrs,
+                const unsigned int* lens, int n)
+{
+    mem_addr_t a;
+    unsigned int len;
+    for(int i = 0; i < n; i++)
+        for(pieces_t p = piecesOf(addrs[i], lens[i], cache->b, cache->split_lines,
+                                  &cache->line_crossing_count); takePiece(&p, &a, &len); )
+            accessObserved(cache, access, ops[i], a, len);
+}
+
+/*
+ * simulateObserved - simulateRun() for a cache with a prefetcher, a
+ * breakdown or a TLB attached; like it, dispatches on the policy once
+ * per run
+ */
+CSIM_INTERNAL void simulateObserved(cache_t* cache, const char* ops, const mem_addr_t* addrs,
+                                    const unsigned int* lens, int n)
+{
+#define OBSERVE(P) observeRun(cache, access_##P, ops, addrs, lens, n)
+    switch(cache->policy) {
+    POLICY_CASES(OBSERVE);
+    }
+#undef OBSERVE
+}
+
+/*
+ * Compact binary trace format (.ctr), written by --convert.
+ * The file starts with CTR_MAGIC and is followed by one record per access:
+ *   tag byte   bits 0-1 op (0 = L, 1 = S, 2 = M), bit 2 sign of the
+ *              address delta, bits 3-7 size, or CTR_SIZE_ESC if the size
+ *              does not fit and follows the delta as a varint
+ *   varint     |addr - previous addr|, 7 bits per byte, low bits first
+ * A tag with op CTR_OP_THREAD is no access: the varint after it is the
+ * thread of the records that follow, which start out as thread 0.
+ */
+#define CTR_MAGIC "CSIMTRC1"
+#define CTR_MAGIC_LEN 8
+#define CTR_SIZE_ESC 31
+#define CTR_OP_THREAD 3
+#define CTR_MAX_RECORD (1 + 10 + 5)
+
+/* Type: Trace reader
+ * A regular file is mapped and parsed in place. Anything else (stdin, a
+ * pipe, a FIFO) is read through a growing buffer that always holds at
+ * least one whole line, or one binary record, ahead of the parser.
+ * cur/end delimit the unparsed bytes either way.
+ */
+typedef struct trace_reader {
+    int fd;
+    pid_t child;        /* decompressor writing to fd, or 0 */
+    pid_t feeder;       /* child passing a stream on to it, or 0 */
+    const char* tool;   /* its name */
+    bool binary;        /* CTR_MAGIC was found at the start */
+    mem_addr_t prev;    /* last address decoded from a binary trace */
+    unsigned int tid;   /* thread of the last record, 0 unless tagged */
+    char* map;          /* mapping of the whole file, or NULL when streaming */
+    size_t map_len;
+    char* buf;          /* streaming buffer */
+    size_t buf_cap;
+    unsigned long long base; /* trace offset of buf[0] */
+    bool eof;
+    const char* cur;
+    const char* end;
+} trace_reader_t;
+
+/* Initial size of the streaming buffer */
+#define TRACE_BUF_SIZE (1 << 20)
+
+/*
+ * fillTrace - move the unparsed tail of the streaming buffer to its front
+ * and read more behind it, growing the buffer if one line fills it.
+ * Returns false once the input is exhausted.
+ */
+static bool fillTrace(trace_reader_t* r)
+{
+    if(r->eof)
+        return false;
+
+    size_t left = r->end - r->cur;
+    if(left == r->buf_cap) {
+        char* buf = realloc(r->buf, r->buf_cap * 2);
+        if(!buf) {
+            fprintf(stderr, "trace: %s\n", strerror(errno));
+            exit(1);
+        }
+        r->buf = buf;
+        r->buf_cap *= 2;
+    } else {
+        r->base += r->cur - r->buf;
+        memmove(r->buf, r->cur, left);
+    }
+    r->cur = r->buf;
+    r->end = r->buf + left;
+
+    ssize_t n;
+    do
+        n = read(r->fd, r->buf + left, r->buf_cap - left);
+    while(n < 0 && errno == EINTR);
+    if(n < 0) {
+        fprintf(stderr, "trace: %s\n", strerror(errno));
+        exit(1);
+    }
+    if(n == 0)
+        r->eof = true;
+    r->end += n;
+    return n > 0;
+}
+
+/*
+ * detectFormat - switch the reader to binary decoding if the trace starts
+ * with CTR_MAGIC
+ */
+static void detectFormat(trace_reader_t* r)
+{
+    while(r->end - r->cur < CTR_MAGIC_LEN && fillTrace(r))
+        ;
+    if(r->end - r->cur >= CTR_MAGIC_LEN &&
+       memcmp(r->cur, CTR_MAGIC, CTR_MAGIC_LEN) == 0) {
+        r->binary = true;
+        r->cur += CTR_MAGIC_LEN;
+    }
+}
+
+/* Type: Decompressor
+ * A compressed trace format, recognized by its magic number, and the
+ * command that decompresses it from standard input to standard output
+ */
+typedef struct decompressor {
+    unsigned char magic[6];
+    int magic_len;
+    const char* argv[4];
+} decompressor_t;
+
+CSIM_INTERNAL const decompressor_t decompressors[] = {
+    { { 0x1f, 0x8b }, 2, { "gzip", "-dc", NULL } },
+    { { 0x28, 0xb5, 0x2f, 0xfd }, 4, { "zstd", "-dcq", NULL } },
+    { { 0xfd, '7', 'z', 'X', 'Z', 0 }, 6, { "xz", "-dc", "-T0", NULL } },
+};
+
+#define NUM_DECOMPRESSORS (int)(sizeof(decompressors) / sizeof(decompressors[0]))
+
+/*
+ * findDecompressor - the decompressor for a trace that starts with the n
+ * bytes at magic, or NULL if they are no known magic number
+ */
+static const decompressor_t* findDecompressor(const unsigned char* magic, ssize_t n)
+{
+    for(int i = 0; i < NUM_DECOMPRESSORS; i++)
+        if(n >= decompressors[i].magic_len &&
+           memcmp(magic, decompressors[i].magic, decompressors[i].magic_len) == 0)
+            return &decompressors[i];
+    return NULL;
+}
+
+/*
+ * spawnFeeder - start a child that writes the bytes already read into
+ * the streaming buffer and then the rest of r->fd to a pipe, so a
+ * decompressor can read a stream from its first byte. Returns the read
+ * end of the pipe.
+ */
+static int spawnFeeder(trace_reader_t* r, const char* trace_fn)
+{
+    int pipe_fds[2];
+    if(pipe(pipe_fds) < 0 || (r->feeder = fork()) < 0) {
+        fprintf(stderr, "%s: %s\n", trace_fn, strerror(errno));
+        exit(1);
+    }
+    if(r->feeder == 0) {
+        close(pipe_fds[0]);
+        const char* p = r->cur;
+        for(;;) {
+            while(p < r->end) {
+                ssize_t n = write(pipe_fds[1], p, r->end - p);
+                if(n < 0 && errno != EINTR)
+                    _exit(1);
+                p += n > 0 ? n : 0;
+            }
+            ssize_t n;
+            do
+                n = read(r->fd, r->buf, r->buf_cap);
+            while(n < 0 && errno == EINTR);
+            if(n <= 0)
+                _exit(n < 0);
+            p = r->buf;
+            r->end = r->buf + n;
+        }
+    }
+    close(pipe_fds[1]);
+    r->cur = r->end = r->buf;
+    r->eof = false;
+    return pipe_fds[0];
+}
+
+/*
+ * spawnDecompressor - run d on the trace open at r->fd in a child process
+ * and make r read its output instead. The child decompresses on its own
+ * CPU while this process parses and simulates. Bytes of a stream that r
+ * has already buffered reach it through a feeder.
+ */
+static void spawnDecompressor(trace_reader_t* r, const decompressor_t* d, const char* trace_fn)
+{
+    int in_fd = r->end > r->cur ? spawnFeeder(r, trace_fn) : r->fd;
+    int pipe_fds[2];
+    if(pipe(pipe_fds) < 0 || (r->child = fork()) < 0) {
+        fprintf(stderr, "%s: %s\n", trace_fn, strerror(errno));
+        exit(1);
+    }
+    if(r->child == 0) {
+        if(in_fd == r->fd)
+            lseek(in_fd, 0, SEEK_SET);
+        if(in_fd != STDIN_FILENO) {
+            dup2(in_fd, STDIN_FILENO);
+            close(in_fd);
+        }
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        execvp(d->argv[0], (char* const*)d->argv);
+        fprintf(stderr, "%s: cannot run %s: %s\n", trace_fn, d->argv[0], strerror(errno));
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+    if(in_fd != r->fd)
+        close(in_fd);
+    if(r->fd != STDIN_FILENO)
+        close(r->fd);
+    r->fd = pipe_fds[0];
+    r->tool = d->argv[0];
+}
+
+/*
+ * openTrace - open trace_fn ("-" is stdin) for reading, mapping it if it
+ * is a regular file and falling back to buffered reads if it is not.
+ * A gzip, zstd or xz compressed file or stream is read from its
+ * decompressor.
+ */
+CSIM_INTERNAL void openTrace(trace_reader_t* r, char* trace_fn)
+{
+    struct stat st;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = strcmp(trace_fn, "-") == 0 ? STDIN_FILENO : open(trace_fn, O_RDONLY);
+    if(r->fd < 0 || fstat(r->fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", trace_fn, strerror(errno));
+        exit(1);
+    }
+
+    const decompressor_t* d = NULL;
+    if(S_ISREG(st.st_mode)) {
+        unsigned char magic[sizeof(decompressors[0].magic)];
+        d = findDecompressor(magic, pread(r->fd, magic, sizeof(magic), 0));
+    }
+    if(S_ISREG(st.st_mode) && !d && st.st_size > 0) {
+        r->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+        if(r->map != MAP_FAILED) {
+            madvise(r->map, st.st_size, MADV_SEQUENTIAL);
+            r->map_len = st.st_size;
+            r->cur = r->map;
+            r->end = r->map + r->map_len;
+            r->eof = true;
+            detectFormat(r);
+            return;
+        }
+        r->map = NULL;
+    }
+
+    r->buf_cap = TRACE_BUF_SIZE;
+    r->buf = malloc(r->buf_cap);
+    if(!r->buf) {
+        fprintf(stderr, "%s: %s\n", trace_fn, strerror(errno));
+        exit(1);
+    }
+    r->cur = r->end = r->buf;
+
+    //a stream can only be looked at through the buffer
+    if(!S_ISREG(st.st_mode)) {
+        while(r->end - r->cur < (ptrdiff_t)sizeof(decompressors[0].magic) && fillTrace(r))
+            ;
+        d = findDecompressor((const unsigned char*)r->cur, r->end - r->cur);
+    }
+    if(d)
+        spawnDecompressor(r, d, trace_fn);
+    detectFormat(r);
+}
+
+/*
+ * closeTrace - release everything openTrace() acquired
+ */
+CSIM_INTERNAL void closeTrace(trace_reader_t* r)
+{
+    if(r->map)
+        munmap(r->map, r->map_len);
+    free(r->buf);
+    if(r->fd != STDIN_FILENO)
+        close(r->fd);
+
+    //a failed decompressor would otherwise pass for a short trace
+    int status;
+    if(r->child > 0 && (waitpid(r->child, &status, 0) < 0 ||
+                        !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        fprintf(stderr, "trace: %s failed\n", r->tool);
+        exit(1);
+    }
+    if(r->feeder > 0)
+        waitpid(r->feeder, NULL, 0);
+}
+
+/*
+ * tellTrace - offset of the next byte to decode, counted in the
+ * decompressed trace
+ */
+CSIM_INTERNAL unsigned long long tellTrace(const trace_reader_t* r)
+{
+    return r->map ? (unsigned long long)(r->cur - r->map) : r->base + (r->cur - r->buf);
+}
+
+/*
+ * seekTrace - continue decoding at offset, a position tellTrace()
+ * returned between two records, with prev the last address decoded
+ * before it. Streams have to read their way there.
+ */
+CSIM_INTERNAL void seekTrace(trace_reader_t* r, unsigned long long offset, mem_addr_t prev)
+{
+    if(r->map) {
+        if(offset > r->map_len) {
+            fprintf(stderr, "trace: cannot seek past its end\n");
+            exit(1);
+        }
+        r->cur = r->map + offset;
+    } else {
+        while(tellTrace(r) < offset) {
+            if(r->cur == r->end && !fillTrace(r)) {
+                fprintf(stderr, "trace: cannot seek past its end\n");
+                exit(1);
+            }
+            unsigned long long skip = offset - tellTrace(r);
+            r->cur += skip < (unsigned long long)(r->end - r->cur) ? skip : (size_t)(r->end - r->cur);
+        }
+    }
+    r->prev = prev;
+}
+
+/*
+ * hexDigit - value of the hex digit c, or -1 if c is not one
+ */
+static inline int hexDigit(unsigned char c)
+{
+    unsigned int d = c - '0';
+    if(d < 10)
+        return d;
+    d = (c | 0x20) - 'a';
+    if(d < 6)
+        return d + 10;
+    return -1;
+}
+
+/*
+ * parseRecord - parse one trace line [p, end) of the form " L addr,len",
+ * or " L addr,len,tid" for a multi-threaded trace (tid is 0 without it).
+ * Returns false for lines that are not data accesses (e.g. "I" lines).
+ */
+static inline bool parseRecord(const char* p, const char* end,
+                               char* op, mem_addr_t* addr, unsigned int* len,
+                               unsigned int* tid)
+{
+    if(end - p < 3 || (p[1] != 'S' && p[1] != 'L' && p[1] != 'M'))
+        return false;
+    *op = p[1];
+    p += 2;
+
+    while(p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if(end - p >= 2 && p[0] == '0' && (p[1] | 0x20) == 'x')
+        p += 2;
+
+    mem_addr_t a = 0;
+    int d;
+    while(p < end && (d = hexDigit(*p)) >= 0) {
+        a = (a << 4) | d;
+        p++;
+    }
+    *addr = a;
+
+    unsigned int l = 0;
+    if(p < end && *p == ',') {
+        p++;
+        while(p < end && (unsigned int)(*p - '0') < 10)
+            l = l * 10 + (*p++ - '0');
+    }
+    *len = l;
+
+    unsigned int t = 0;
+    if(p < end && *p == ',') {
+        p++;
+        while(p < end && (unsigned int)(*p - '0') < 10)
+            t = t * 10 + (*p++ - '0');
+    }
+    *tid = t;
+    return true;
+}
+
+/*
+ * getVarint - decode a varint at *p, advancing *p past it
+ */
+static inline uint64_t getVarint(const unsigned char** p, const unsigned char* end)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    while(*p < end) {
+        unsigned char byte = *(*p)++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            break;
+        shift += 7;
+    }
+    return v;
+}
+
+/*
+ * putVarint - encode v as a varint into out, returning its length
+ */
+static inline int putVarint(unsigned char* out, uint64_t v)
+{
+    int n = 0;
+    while(v >= 0x80) {
+        out[n++] = (unsigned char)v | 0x80;
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+/*
+ * nextBinaryRecord - decode the next record of a binary trace
+ */
+static bool nextBinaryRecord(trace_reader_t* r, char* op, mem_addr_t* addr, unsigned int* len)
+{
+    const unsigned char* p;
+    const unsigned char* end;
+    unsigned char tag;
+    for(;;) {
+        if(r->end - r->cur < CTR_MAX_RECORD)
+            while(fillTrace(r) && r->end - r->cur < CTR_MAX_RECORD)
+                ;
+        if(r->cur == r->end)
+            return false;
+
+        p = (const unsigned char*)r->cur;
+        end = (const unsigned char*)r->end;
+        tag = *p++;
+        if((tag & 3) != CTR_OP_THREAD)
+            break;
+        r->tid = getVarint(&p, end);
+        r->cur = (const char*)p;
+    }
+    mem_addr_t delta = getVarint(&p, end);
+    unsigned int size = tag >> 3;
+    if(size == CTR_SIZE_ESC)
+        size = getVarint(&p, end);
+
+    r->prev = tag & 4 ? r->prev - delta : r->prev + delta;
+    *op = "LSM?"[tag & 3];
+    *addr = r->prev;
+    *len = size;
+    r->cur = (const char*)p;
+    return true;
+}
+
+/*
+ * nextRecord - fetch the next data access from the trace.
+ * Returns false at the end of the trace.
+ */
+CSIM_INTERNAL bool nextRecord(trace_reader_t* r, char* op, mem_addr_t* addr, unsigned int* len)
+{
+    if(r->binary)
+        return nextBinaryRecord(r, op, addr, len);
+
+    for(;;) {
+        const char* nl = memchr(r->cur, '\n', r->end - r->cur);
+        if(!nl) {
+            //no complete line left: refill, or parse the unterminated tail
+            if(fillTrace(r))
+                continue;
+            if(r->cur == r->end)
+                return false;
+            nl = r->end;
+        }
+
+        const char* line = r->cur;
+        r->cur = nl < r->end ? nl + 1 : nl;
+        if(parseRecord(line, nl, op, addr, len, &r->tid))
+            return true;
+    }
+}
+
+/* Type: Access batch
+ * A run of decoded accesses; an "M" record becomes a load and a store
+ */
+#define BATCH_SIZE 4096
+
+typedef struct access_batch {
+    int n;
+    unsigned long long end_offset; /* tellTrace() after the last record */
+    mem_addr_t end_prev;           /* the reader's prev there */
+    char op[BATCH_SIZE];
+    mem_addr_t addr[BATCH_SIZE];
+    unsigned int len[BATCH_SIZE];
+    unsigned int tid[BATCH_SIZE]; /* set by fillBatch() only */
+} access_batch_t;
+
+/*
+ * fillBatch - decode accesses from the trace into batch until it is full
+ * or the trace ends. Returns the number of accesses decoded.
+ */
+CSIM_INTERNAL int fillBatch(trace_reader_t* reader, access_batch_t* batch)
+{
+    char op;
+    mem_addr_t addr=0;
+    unsigned int len=0;
+
+    batch->n = 0;
+    while(batch->n <= BATCH_SIZE - 2 && nextRecord(reader, &op, &addr, &len)) {
+        if(verbosity)
+            printf("%c %llx,%u \n", op, addr, len);
+
+        //a data modify is a load followed by a store to the same address
+        batch->op[batch->n] = op == 'M' ? 'L' : op;
+        batch->addr[batch->n] = addr;
+        batch->tid[batch->n] = reader->tid;
+        batch->len[batch->n++] = len;
+        if(op == 'M') {
+            batch->op[batch->n] = 'S';
+            batch->addr[batch->n] = addr;
+            batch->tid[batch->n] = reader->tid;
+            batch->len[batch->n++] = len;
+        }
+    }
+    batch->end_offset = tellTrace(reader);
+    batch->end_prev = reader->prev;
+    return batch->n;
+}
+
+/* Type: Sampling
+ * Simulating a subset of a cache's accesses and extrapolating totals:
+ *   set sampling   only the sets picked by a hash, about 1 in set_ratio
+ *   time sampling  every period accesses, warmup accesses that only warm
+ *                  the cache up followed by a window of window measured
+ *                  accesses; the rest skip the cache
+ * The counters SAMPLED_COUNTERS lists are collected from the measured
+ * accesses only and scaled up by finishSampling(), which also estimates
+ * the 95% confidence interval of the hits and misses from the spread
+ * between sampled sets or windows. Line crossings are always counted for
+ * every access.
+ */
+#define SAMPLED_COUNTERS(X) \
+    X(hit_count) X(miss_count) X(eviction_count) X(dirty_eviction_count) X(write_bytes) \
+    X(write_count)
+
+typedef struct sampling {
+    int set_ratio;              /* 0 without set sampling */
+    char* set_sampled;          /* per set: simulate it */
+    size_t nsampled;
+    unsigned long long* set_hits;
+    unsigned long long* set_misses;
+
+    unsigned long long window;  /* 0 without time sampling */
+    unsigned long long period;
+    unsigned long long warmup;
+    unsigned long long seen;    /* accesses so far, split ones counted per block */
+    unsigned long long win_hits; /* measured in the current window */
+    unsigned long long win_accesses;
+    unsigned long long nwindows; /* Welford's running mean and M2 of the hit */
+    double ratio_mean;           /* ratios of the finished windows */
+    double ratio_m2;
+
+    unsigned long long measured_accesses;
+#define DECLARE(field) unsigned long long field;
+    struct { SAMPLED_COUNTERS(DECLARE) } measured;
+#undef DECLARE
+
+    double hits_ci;             /* set by finishSampling() */
+    double misses_ci;
+
+    access_batch_t pending;     /* gathered accesses yet to be measured */
+} sampling_t;
+
+/*
+ * initSampling - set up the sampling of cache: set_ratio > 0 samples
+ * sets, window > 0 samples time, and attach it
+ */
+CSIM_INTERNAL void initSampling(sampling_t* smp, cache_t* cache, int set_ratio,
+                                unsigned long long window, unsigned long long period,
+                                unsigned long long warmup)
+{
+    memset(smp, 0, sizeof(*smp));
+    smp->set_ratio = set_ratio;
+    smp->window = window;
+    smp->period = period;
+    smp->warmup = warmup;
+    if(set_ratio > 0) {
+        smp->set_sampled = sdAlloc(cache->S, 1);
+        smp->set_hits = sdAlloc(cache->S, sizeof(unsigned long long));
+        smp->set_misses = sdAlloc(cache->S, sizeof(unsigned long long));
+        //hash the index so strides over the sets still meet a fair sample
+        for(size_t i = 0; i < cache->S; i++)
+            if((i * 0x9e3779b97f4a7c15ULL >> 32) % set_ratio == 0) {
+                smp->set_sampled[i] = 1;
+                smp->nsampled++;
+            }
+        if(smp->nsampled == 0) {
+            smp->set_sampled[0] = 1;
+            smp->nsampled = 1;
+        }
+    }
+    cache->sampling = smp;
+}
+
+/*
+ * freeSampling - free what initSampling() allocated
+ */
+CSIM_INTERNAL void freeSampling(sampling_t* smp)
+{
+    free(smp->set_sampled);
+    free(smp->set_hits);
+    free(smp->set_misses);
+}
+
+/*
+ * endWindow - fold the current window into the running statistics
+ */
+static void endWindow(sampling_t* smp)
+{
+    if(smp->win_accesses == 0)
+        return;
+    double ratio = (double)smp->win_hits / smp->win_accesses;
+    double delta = ratio - smp->ratio_mean;
+    smp->ratio_mean += delta / ++smp->nwindows;
+    smp->ratio_m2 += delta * (ratio - smp->ratio_mean);
+    smp->win_hits = 0;
+    smp->win_accesses = 0;
+}
+
+/*
+ * measureRun - simulate n gathered accesses one at a time, adding what
+ * each does to the measured counters and to its set's or window's tally
+ */
+static void measureRun(cache_t* cache, const char* ops, const mem_addr_t* addrs,
+                       const unsigned int* lens, int n)
+{
+    sampling_t* smp = cache->sampling;
+    for(int i = 0; i < n; i++) {
+#define SNAPSHOT(field) unsigned long long field = cache->field;
+        SAMPLED_COUNTERS(SNAPSHOT)
+#undef SNAPSHOT
+        accessData(cache, ops[i], addrs[i], lens[i]);
+#define MEASURE(field) smp->measured.field += cache->field - field;
+        SAMPLED_COUNTERS(MEASURE)
+#undef MEASURE
+        smp->measured_accesses++;
+
+        bool hit = cache->hit_count != hit_count;
+        if(smp->set_ratio) {
+            size_t set = (addrs[i] >> cache->b) & (cache->S - 1);
+            if(hit)
+                smp->set_hits[set]++;
+            else
+                smp->set_misses[set]++;
+        } else {
+            smp->win_hits += hit;
+            smp->win_accesses++;
+        }
+    }
+}
+
+/*
+ * flushSampled - measure the gathered accesses
+ */
+static void flushSampled(cache_t* cache)
+{
+    access_batch_t* g = &cache->sampling->pending;
+    measureRun(cache, g->op, g->addr, g->len, g->n);
+    g->n = 0;
+}
+
+/*
+ * sampleAccess - drop an access outside the sample, simulate it quietly
+ * if it warms the cache up, or gather it for measuring
+ */
+static void sampleAccess(cache_t* cache, char op, mem_addr_t addr, unsigned int len)
+{
+    sampling_t* smp = cache->sampling;
+    access_batch_t* g = &smp->pending;
+
+    unsigned long long at = smp->seen++;
+    if(smp->window) {
+        at %= smp->period;
+        if(at < smp->period - smp->window - smp->warmup)
+            return;
+        if(at < smp->period - smp->window) {
+            flushSampled(cache);
+            accessData(cache, op, addr, len);
+            return;
+        }
+    } else if(!smp->set_sampled[(addr >> cache->b) & (cache->S - 1)]) {
+        return;
+    }
+
+    g->op[g->n] = op;
+    g->addr[g->n] = addr;
+    g->len[g->n++] = len;
+    if(g->n == BATCH_SIZE)
+        flushSampled(cache);
+    if(smp->window && smp->seen % smp->period == 0) {
+        flushSampled(cache);
+        endWindow(smp);
+    }
+}
+
+/*
+ * simulateSampled - simulateRun() for a sampled cache; the accesses are
+ * split into blocks, if asked to, before they are sampled
+ */
+CSIM_INTERNAL void simulateSampled(cache_t* cache, const char* ops, const mem_addr_t* addrs,
+                                   const unsigned int* lens, int n)
+{
+    mem_addr_t a;
+    unsigned int len;
+    for(int i = 0; i < n; i++)
+        for(pieces_t p = piecesOf(addrs[i], lens[i], cache->b, cache->split_lines,
+                                  &cache->line_crossing_count); takePiece(&p, &a, &len); )
+            sampleAccess(cache, ops[i], a, len);
+    flushSampled(cache);
+}
+
+/*
+ * finishSampling - replace the counters of a sampled cache with their
+ * extrapolated totals and estimate the confidence intervals. Both modes
+ * estimate the hit ratio and scale it by the accesses seen, which are
+ * known exactly.
+ */
+CSIM_INTERNAL void finishSampling(cache_t* cache)
+{
+    sampling_t* smp = cache->sampling;
+    double N = smp->seen;
+    double var = 0;
+
+    if(smp->set_ratio) {
+        //ratio estimator over a sample of sets drawn without replacement
+        double n = smp->nsampled, R = 0, mean = 0, d2 = 0;
+        if(smp->measured_accesses)
+            R = (double)smp->measured.hit_count / smp->measured_accesses;
+        for(size_t i = 0; i < cache->S; i++)
+            if(smp->set_sampled[i]) {
+                double a = smp->set_hits[i] + smp->set_misses[i];
+                double d = smp->set_hits[i] - R * a;
+                mean += a / n;
+                d2 += d * d;
+            }
+        if(n > 1 && mean > 0)
+            var = (1 - n / cache->S) * d2 / (n - 1) / (n * mean * mean);
+    } else {
+        //every window is a sample of the hit ratio of the whole trace
+        endWindow(smp);
+        double fraction = N ? smp->measured_accesses / N : 1;
+        if(smp->nwindows > 1)
+            var = (1 - fraction) * smp->ratio_m2 / (smp->nwindows - 1) / smp->nwindows;
+    }
+    smp->hits_ci = smp->misses_ci = 1.96 * N * sqrt(var);
+
+    double scale = smp->measured_accesses ? N / smp->measured_accesses : 0;
+#define EXTRAPOLATE(field) cache->field = llround(smp->measured.field * scale);
+    SAMPLED_COUNTERS(EXTRAPOLATE)
+#undef EXTRAPOLATE
+}
+
+/*
+ * simulateAny - the n accesses through cache, with its sampling, prefetcher
+ * or breakdown if it has one
+ */
+static void simulateAny(cache_t* cache, const char* ops, const mem_addr_t* addrs,
+                        const unsigned int* lens, int n)
+{
+    if(cache->sampling)
+        simulateSampled(cache, ops, addrs, lens, n);
+    else if(cache->prefetcher || cache->detail || cache->tlb)
+        simulateObserved(cache, ops, addrs, lens, n);
+    else
+        simulateRun(cache, ops, addrs, lens, n);
+}
+
+/* Type: Interval statistics
+ * --interval splits the run into windows of every accesses and prints,
+ * for each, its hits, misses and evictions and its working set, the
+ * number of distinct blocks it touched. Those blocks are kept in an
+ * open addressing set of block + 1 (0 is empty), cleared every window
+ * and shrunk back once a window touches far fewer blocks than it holds.
+ */
+typedef struct interval {
+    unsigned long long every; /* accesses per window */
+    unsigned long long index; /* windows printed so far */
+    unsigned long long left;  /* accesses left in the current window */
+    unsigned long long hits, misses, evictions; /* counters at its start */
+    mem_addr_t* blocks;
+    size_t slots;             /* a power of 2 */
+    size_t nblocks;
+} interval_t;
+
+/*
+ * initInterval - attach an interval window of every accesses to cache
+ */
+CSIM_INTERNAL void initInterval(interval_t* iv, cache_t* cache, unsigned long long every)
+{
+    memset(iv, 0, sizeof(*iv));
+    iv->every = iv->left = every;
+    iv->slots = SD_HASH_SLOTS;
+    iv->blocks = sdAlloc(iv->slots, sizeof(mem_addr_t));
+    cache->interval = iv;
+}
+
+/*
+ * freeInterval - free what initInterval() and the replay allocated
+ */
+CSIM_INTERNAL void freeInterval(interval_t* iv)
+{
+    free(iv->blocks);
+}
+
+/*
+ * touchBlock - add block to the working set of the current window
+ */
+static void touchBlock(interval_t* iv, mem_addr_t block)
+{
+    size_t i = (block * 0x9e3779b97f4a7c15ULL) >> 20 & (iv->slots - 1);
+    while(iv->blocks[i] && iv->blocks[i] != block + 1)
+        i = (i + 1) & (iv->slots - 1);
+    if(iv->blocks[i])
+        return;
+    iv->blocks[i] = block + 1;
+
+    //keep the set at most half full
+    if(++iv->nblocks * 2 > iv->slots) {
+        mem_addr_t* old = iv->blocks;
+        size_t slots = iv->slots;
+        iv->slots *= 2;
+        iv->blocks = sdAlloc(iv->slots, sizeof(mem_addr_t));
+        for(size_t j = 0; j < slots; j++)
+            if(old[j]) {
+                i = ((old[j] - 1) * 0x9e3779b97f4a7c15ULL) >> 20 & (iv->slots - 1);
+                while(iv->blocks[i])
+                    i = (i + 1) & (iv->slots - 1);
+                iv->blocks[i] = old[j];
+            }
+        free(old);
+    }
+}
+
+/*
+ * endInterval - print the window that just ended and start the next
+ */
+static void endInterval(cache_t* cache)
+{
+    interval_t* iv = cache->interval;
+    printf("interval:%llu s:%d E:%d b:%d accesses:%llu hits:%llu misses:%llu "
+           "evictions:%llu working-set:%zu\n",
+           iv->index++, cache->s, cache->E, cache->b, iv->every - iv->left,
+           cache->hit_count - iv->hits, cache->miss_count - iv->misses,
+           cache->eviction_count - iv->evictions, iv->nblocks);
+    iv->left = iv->every;
+    iv->hits = cache->hit_count;
+    iv->misses = cache->miss_count;
+    iv->evictions = cache->eviction_count;
+
+    //clearing costs no more than the window touched: a set grown by a
+    //wider window than this one starts over at the initial size
+    if(iv->slots > SD_HASH_SLOTS && iv->nblocks * 8 < iv->slots) {
+        free(iv->blocks);
+        iv->slots = SD_HASH_SLOTS;
+        iv->blocks = sdAlloc(iv->slots, sizeof(mem_addr_t));
+    } else {
+        memset(iv->blocks, 0, iv->slots * sizeof(mem_addr_t));
+    }
+    iv->nblocks = 0;
+}
+
+/*
+ * simulateInterval - the n accesses through cache, ending a window
+ * whenever one is full
+ */
+static void simulateInterval(cache_t* cache, const char* ops, const mem_addr_t* addrs,
+                             const unsigned int* lens, int n)
+{
+    interval_t* iv = cache->interval;
+    while(n > 0) {
+        int m = (unsigned long long)n < iv->left ? n : (int)iv->left;
+        simulateAny(cache, ops, addrs, lens, m);
+        for(int i = 0; i < m; i++) {
+            //a split access touches every block it covers
+            mem_addr_t last = cache->split_lines && lens[i] ? addrs[i] + lens[i] - 1 : addrs[i];
+            for(mem_addr_t blk = addrs[i] >> cache->b; blk <= last >> cache->b; blk++)
+                touchBlock(iv, blk);
+        }
+        iv->left -= m;
+        if(iv->left == 0)
+            endInterval(cache);
+        ops += m;
+        addrs += m;
+        lens += m;
+        n -= m;
+    }
+}
+
+/*
+ * finishInterval - print the last, partial window if it saw any access
+ */
+CSIM_INTERNAL void finishInterval(cache_t* cache)
+{
+    if(cache->interval->left < cache->interval->every)
+        endInterval(cache);
+}
+
+/*
+ * simulateBatch - run every access of batch through each of the caches
+ */
+CSIM_INTERNAL void simulateBatch(cache_t* const* caches, int ncaches, const access_batch_t* batch)
+{
+    for(int i = 0; i < ncaches; i++)
+        if(caches[i]->interval)
+            simulateInterval(caches[i], batch->op, batch->addr, batch->len, batch->n);
+        else
+            simulateAny(caches[i], batch->op, batch->addr, batch->len, batch->n);
+}
+
+/* Type: Batch ring
+ * Batches decoded once by the reader and consumed by every sweep worker.
+ * A slot can be refilled once all workers have released it.
+ */
+#define RING_SLOTS 8
+
+typedef struct batch_ring {
+    access_batch_t slots[RING_SLOTS];
+    int pending[RING_SLOTS];    /* workers yet to finish each slot */
+    long produced;              /* batches published so far */
+    bool done;                  /* the reader hit the end of the trace */
+    int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+} batch_ring_t;
+
+/* Type: Sweep worker
+ * One thread and the caches it owns
+ */
+typedef struct sweep_worker {
+    pthread_t thread;
+    batch_ring_t* ring;
+    cache_t** caches;
+    int ncaches;
+} sweep_worker_t;
+
+/*
+ * sweepWorker - thread body: replay every published batch against the
+ * worker's own caches, in order
+ */
+CSIM_INTERNAL void* sweepWorker(void* arg)
+{
+    sweep_worker_t* w = arg;
+    batch_ring_t* ring = w->ring;
+
+    for(long seq = 0; ; seq++) {
+        int slot = seq % RING_SLOTS;
+
+        pthread_mutex_lock(&ring->lock);
+        while(ring->produced <= seq && !ring->done)
+            pthread_cond_wait(&ring->filled, &ring->lock);
+        bool finished = ring->produced <= seq;
+        pthread_mutex_unlock(&ring->lock);
+        if(finished)
+            return NULL;
+
+        simulateBatch(w->caches, w->ncaches, &ring->slots[slot]);
+
+        pthread_mutex_lock(&ring->lock);
+        if(--ring->pending[slot] == 0)
+            pthread_cond_signal(&ring->drained);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+/*
+ * replayParallel - decode the trace once into the batch ring while
+ * nworkers threads each simulate their share of the caches
+ */
+CSIM_INTERNAL void replayParallel(trace_reader_t* reader, cache_t* caches, int ncaches,
+                                  int nworkers)
+{
+    batch_ring_t* ring = malloc(sizeof(batch_ring_t));
+    sweep_worker_t* workers = calloc(nworkers, sizeof(sweep_worker_t));
+    cache_t** owned = malloc(ncaches * sizeof(cache_t*));
+    if(!ring || !workers || !owned) {
+        fprintf(stderr, "replayTrace: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    memset(ring->pending, 0, sizeof(ring->pending));
+    ring->produced = 0;
+    ring->done = false;
+    ring->nworkers = nworkers;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->filled, NULL);
+    pthread_cond_init(&ring->drained, NULL);
+
+    //deal the caches out round robin, each worker's share contiguous in owned
+    int next = 0;
+    for(int w = 0; w < nworkers; w++) {
+        workers[w].ring = ring;
+        workers[w].caches = owned + next;
+        for(int i = w; i < ncaches; i += nworkers)
+            owned[next++] = &caches[i];
+        workers[w].ncaches = owned + next - workers[w].caches;
+        if(pthread_create(&workers[w].thread, NULL, sweepWorker, &workers[w]) != 0) {
+            fprintf(stderr, "replayTrace: cannot start worker thread\n");
+            exit(1);
+        }
+    }
+
+    for(long seq = 0; ; seq++) {
+        int slot = seq % RING_SLOTS;
+
+        pthread_mutex_lock(&ring->lock);
+        while(ring->pending[slot] > 0)
+            pthread_cond_wait(&ring->drained, &ring->lock);
+        pthread_mutex_unlock(&ring->lock);
+
+        //the slot is free, so this thread alone touches it until published
+        int n = fillBatch(reader, &ring->slots[slot]);
+
+        pthread_mutex_lock(&ring->lock);
+        if(n > 0) {
+            ring->pending[slot] = nworkers;
+            ring->produced++;
+        } else {
+            ring->done = true;
+        }
+        pthread_cond_broadcast(&ring->filled);
+        pthread_mutex_unlock(&ring->lock);
+        if(n == 0)
+            break;
+    }
+
+    for(int w = 0; w < nworkers; w++)
+        pthread_join(workers[w].thread, NULL);
+
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->filled);
+    pthread_cond_destroy(&ring->drained);
+    free(owned);
+    free(workers);
+    free(ring);
+}
+
+/* Type: Shard queue
+ * Single producer, single consumer ring of accesses bound for one set
+ * shard. The producer publishes tail and the consumer publishes head;
+ * each side caches the other's index and only rereads it when the ring
+ * looks full or empty.
+ */
+#define SHARD_QUEUE_SIZE (1 << 16)
+
+typedef struct shard_queue {
+    _Alignas(CACHE_ALIGN) atomic_size_t head;
+    _Alignas(CACHE_ALIGN) atomic_size_t tail;
+    _Alignas(CACHE_ALIGN) atomic_bool done;
+    size_t head_seen;   /* producer's copy of head */
+    size_t tail_local;  /* producer's unpublished tail */
+    char op[SHARD_QUEUE_SIZE];
+    mem_addr_t addr[SHARD_QUEUE_SIZE];
+    unsigned int len[SHARD_QUEUE_SIZE];
+} shard_queue_t;
+
+/* Type: Set shard
+ * One thread simulating a contiguous block of the sets of a cache, so
+ * that no two threads fill lines of the tag and replacement arrays that
+ * share a cache line, except where two blocks meet.
+ * view shares the cache's line arrays but has its own counters, which
+ * are added back into the cache once the thread is done.
+ */
+typedef struct set_shard {
+    pthread_t thread;
+    cache_t view;
+    shard_queue_t* queue;
+} set_shard_t;
+
+/*
+ * shardPush - queue an access for a shard, waiting while its ring is full
+ */
+static inline void shardPush(shard_queue_t* q, char op, mem_addr_t addr, unsigned int len)
+{
+    while(q->tail_local - q->head_seen == SHARD_QUEUE_SIZE) {
+        atomic_store_explicit(&q->tail, q->tail_local, memory_order_release);
+        q->head_seen = atomic_load_explicit(&q->head, memory_order_acquire);
+        if(q->tail_local - q->head_seen == SHARD_QUEUE_SIZE)
+            sched_yield();
+    }
+    size_t at = q->tail_local++ % SHARD_QUEUE_SIZE;
+    q->op[at] = op;
+    q->addr[at] = addr;
+    q->len[at] = len;
+}
+
+/*
+ * shardWorker - thread body: simulate the queued accesses of one shard in
+ * trace order until the producer is done and the queue is empty
+ */
+CSIM_INTERNAL void* shardWorker(void* arg)
+{
+    set_shard_t* shard = arg;
+    shard_queue_t* q = shard->queue;
+    size_t head = 0;
+
+    for(;;) {
+        size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if(head == tail) {
+            if(atomic_load_explicit(&q->done, memory_order_acquire) &&
+               head == atomic_load_explicit(&q->tail, memory_order_acquire))
+                return NULL;
+            sched_yield();
+            continue;
+        }
+        //simulate up to the end of the ring, then the part that wrapped
+        while(head != tail) {
+            size_t at = head % SHARD_QUEUE_SIZE;
+            size_t n = tail - head < SHARD_QUEUE_SIZE - at ? tail - head : SHARD_QUEUE_SIZE - at;
+            simulateRun(&shard->view, q->op + at, q->addr + at, q->len + at, n);
+            head += n;
+        }
+        atomic_store_explicit(&q->head, head, memory_order_release);
+    }
+}
+
+/*
+ * replaySharded - simulate one cache on up to nshards threads. Sets never
+ * interact, so each thread owns a fixed block of them and receives just
+ * the accesses that map there, in trace order; the totals are identical
+ * to a serial replay.
+ */
+CSIM_INTERNAL void replaySharded(trace_reader_t* reader, cache_t* cache, int nshards)
+{
+    size_t shard_sets = (cache->S + nshards - 1) / nshards;
+    nshards = (cache->S + shard_sets - 1) / shard_sets;
+    set_shard_t* shards = calloc(nshards, sizeof(set_shard_t));
+    access_batch_t* batch = malloc(sizeof(access_batch_t));
+    if(!shards || !batch) {
+        fprintf(stderr, "replayTrace: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    for(int i = 0; i < nshards; i++) {
+        shards[i].view = *cache;
+        shards[i].view.hit_count = 0;
+        shards[i].view.miss_count = 0;
+        shards[i].view.eviction_count = 0;
+        shards[i].view.dirty_eviction_count = 0;
+        shards[i].view.write_bytes = 0;
+        shards[i].view.write_count = 0;
+        shards[i].queue = aligned_alloc(CACHE_ALIGN, sizeof(shard_queue_t));
+        if(!shards[i].queue) {
+            fprintf(stderr, "replayTrace: %s\n", strerror(errno));
+            exit(1);
+        }
+        atomic_init(&shards[i].queue->head, 0);
+        atomic_init(&shards[i].queue->tail, 0);
+        atomic_init(&shards[i].queue->done, false);
+        shards[i].queue->head_seen = 0;
+        shards[i].queue->tail_local = 0;
+        if(pthread_create(&shards[i].thread, NULL, shardWorker, &shards[i]) != 0) {
+            fprintf(stderr, "replayTrace: cannot start worker thread\n");
+            exit(1);
+        }
+    }
+
+    while(fillBatch(reader, batch) > 0) {
+        for(int j = 0; j < batch->n; j++) {
+            //a split access may touch several shards, so split it here
+            mem_addr_t a;
+            unsigned int len;
+            for(pieces_t p = piecesOf(batch->addr[j], batch->len[j], cache->b, cache->split_lines,
+                                      &cache->line_crossing_count); takePiece(&p, &a, &len); ) {
+                size_t s_bits = (a >> cache->b) & (cache->S - 1);
+                shardPush(shards[s_bits / shard_sets].queue, batch->op[j], a, len);
+            }
+        }
+        for(int i = 0; i < nshards; i++)
+            atomic_store_explicit(&shards[i].queue->tail, shards[i].queue->tail_local,
+                                  memory_order_release);
+    }
+
+    for(int i = 0; i < nshards; i++)
+        atomic_store_explicit(&shards[i].queue->done, true, memory_order_release);
+    for(int i = 0; i < nshards; i++) {
+        pthread_join(shards[i].thread, NULL);
+        cache->hit_count += shards[i].view.hit_count;
+        cache->miss_count += shards[i].view.miss_count;
+        cache->eviction_count += shards[i].view.eviction_count;
+        cache->dirty_eviction_count += shards[i].view.dirty_eviction_count;
+        cache->write_bytes += shards[i].view.write_bytes;
+        cache->write_count += shards[i].view.write_count;
+        free(shards[i].queue);
+    }
+    free(batch);
+    free(shards);
+}
+
+/*
+ * wallClock - seconds on a monotonic clock
+ */
+CSIM_INTERNAL double wallClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Type: Profile
+ * Where a --profile replay spent its time: the parse phase reads and
+ * decodes the trace into batches, the simulate phase runs them through
+ * the model. Each phase also collects the simulator's own hardware
+ * counts where perf_event_open() lets it count them.
+ */
+typedef enum phase {
+    PHASE_PARSE,
+    PHASE_SIMULATE,
+    NUM_PHASES
+} phase_t;
+
+CSIM_INTERNAL const char* phase_names[NUM_PHASES] = { "parse", "simulate" };
+
+typedef enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    NUM_PERF_COUNTERS
+} perf_counter_t;
+
+CSIM_INTERNAL const char* perf_counter_names[NUM_PERF_COUNTERS] = {
+    "cycles", "instructions", "llc-misses"
+};
+
+typedef struct profile {
+    bool enabled;
+    int fds[NUM_PERF_COUNTERS];     /* -1 for counters that did not open */
+    double seconds[NUM_PHASES];
+    unsigned long long counts[NUM_PHASES][NUM_PERF_COUNTERS];
+    unsigned long long accesses;    /* accesses the simulate phase ran */
+
+    /* The phase running since the last profileSwitch() */
+    phase_t phase;                  /* NUM_PHASES outside a replay */
+    double since;
+    unsigned long long since_counts[NUM_PERF_COUNTERS];
+} profile_t;
+
+/* Collected by the replays while --profile is set */
+CSIM_INTERNAL profile_t profile = { .phase = NUM_PHASES };
+
+/*
+ * initProfile - enable profiling and open whichever counters the kernel
+ * allows, counting this thread in user space
+ */
+CSIM_INTERNAL void initProfile(void)
+{
+    profile.enabled = true;
+    for(int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        profile.fds[i] = -1;
+#ifdef __linux__
+        static const uint64_t configs[NUM_PERF_COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+        };
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        profile.fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+}
+
+/*
+ * readCounters - current value of every open counter
+ */
+static void readCounters(unsigned long long* counts)
+{
+    for(int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        uint64_t v = 0;
+        if(profile.fds[i] >= 0 && read(profile.fds[i], &v, sizeof(v)) != sizeof(v))
+            v = 0;
+        counts[i] = v;
+    }
+}
+
+/*
+ * profileSwitch - charge the time and counts since the last switch to
+ * the phase that was running and start phase (NUM_PHASES stops)
+ */
+static inline void profileSwitch(phase_t phase)
+{
+    if(!profile.enabled)
+        return;
+    double now = wallClock();
+    unsigned long long counts[NUM_PERF_COUNTERS];
+    readCounters(counts);
+    if(profile.phase != NUM_PHASES) {
+        profile.seconds[profile.phase] += now - profile.since;
+        for(int i = 0; i < NUM_PERF_COUNTERS; i++)
+            profile.counts[profile.phase][i] += counts[i] - profile.since_counts[i];
+    }
+    profile.phase = phase;
+    profile.since = now;
+    memcpy(profile.since_counts, counts, sizeof(counts));
+}
+
+/*
+ * printProfile - print the time, time per access and counts of each phase
+ */
+CSIM_INTERNAL void printProfile(void)
+{
+    for(phase_t p = 0; p < NUM_PHASES; p++) {
+        printf("phase:%s seconds:%.6f ns/access:%.2f", phase_names[p], profile.seconds[p],
+               profile.accesses ? profile.seconds[p] * 1e9 / profile.accesses : 0.0);
+        for(int i = 0; i < NUM_PERF_COUNTERS; i++)
+            if(profile.fds[i] >= 0)
+                printf(" %s:%llu", perf_counter_names[i], profile.counts[p][i]);
+            else
+                printf(" %s:n/a", perf_counter_names[i]);
+        printf("\n");
+    }
+    printf("accesses:%llu\n", profile.accesses);
+}
+
+/* Type: Checkpoint
+ * Snapshot of a replay: the full state and counters of every cache and
+ * where in the trace the next batch starts. The file is a
+ * checkpoint_header_t and the trace name, then per cache a
+ * checkpoint_cache_t and the cache's block, each starting at a multiple
+ * of CACHE_ALIGN so the blocks can be used straight from a mapping.
+ * Fields are in the byte order of the machine that wrote them.
+ */
+#define CKPT_MAGIC "CSIMCKP2"
+
+#define CHECKPOINT_COUNTERS(X) \
+    X(miss_count) X(hit_count) X(eviction_count) X(dirty_eviction_count) X(write_bytes) \
+    X(write_count) X(line_crossing_count) X(useful_prefetch_count) X(polluting_prefetch_count) X(clock)
+
+typedef struct checkpoint_header {
+    char magic[8];          /* CKPT_MAGIC */
+    uint32_t ncaches;
+    uint32_t trace_len;     /* bytes of the trace name that follows */
+    uint64_t trace_size;    /* size of the trace file, 0 if it is not one */
+    uint64_t offset;        /* trace offset of the next batch */
+    uint64_t prev;          /* binary traces: the address decoded last */
+    uint64_t accesses;      /* accesses replayed before offset */
+} checkpoint_header_t;
+
+typedef struct checkpoint_cache {
+    int32_t s, E, b, policy, write_mode, split_lines;
+#define DECLARE(field) uint64_t field;
+    CHECKPOINT_COUNTERS(DECLARE)
+#undef DECLARE
+    uint64_t block_size;
+} checkpoint_cache_t;
+
+/* Type: Resume point
+ * Where a restored replay resumes, all zero for a cold start, and how
+ * far a checkpointing replay has got
+ */
+typedef struct resume_point {
+    unsigned long long offset;
+    mem_addr_t prev;
+    unsigned long long accesses;    /* replayed so far, counting the restored ones */
+} resume_point_t;
+
+CSIM_INTERNAL resume_point_t resume;
+
+/*
+ * traceSize - size of the trace file, 0 for standard input or if it is
+ * not a regular file
+ */
+static unsigned long long traceSize(const char* trace_fn)
+{
+    struct stat st;
+    if(strcmp(trace_fn, "-") == 0 || stat(trace_fn, &st) < 0 || !S_ISREG(st.st_mode))
+        return 0;
+    return st.st_size;
+}
+
+/*
+ * padFile - write zeros up to the next multiple of CACHE_ALIGN
+ */
+static void padFile(FILE* fp)
+{
+    static const char zeros[CACHE_ALIGN];
+    long at = ftell(fp);
+    fwrite(zeros, 1, (CACHE_ALIGN - at % CACHE_ALIGN) % CACHE_ALIGN, fp);
+}
+
+/*
+ * writeCheckpoint - snapshot the ncaches caches replaying trace_fn, whose
+ * next batch starts at offset, to checkpoint_file. The snapshot is
+ * written beside it and renamed over it, so a crash keeps the last one.
+ */
+CSIM_INTERNAL void writeCheckpoint(cache_t* caches, int ncaches, const char* trace_fn,
+                                   unsigned long long offset, mem_addr_t prev)
+{
+    char* tmp_fn = malloc(strlen(checkpoint_file) + 5);
+    if(!tmp_fn) {
+        fprintf(stderr, "checkpoint: %s\n", strerror(errno));
+        exit(1);
+    }
+    sprintf(tmp_fn, "%s.tmp", checkpoint_file);
+    FILE* fp = fopen(tmp_fn, "wb");
+    if(!fp) {
+        fprintf(stderr, "%s: %s\n", tmp_fn, strerror(errno));
+        exit(1);
+    }
+
+    checkpoint_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CKPT_MAGIC, sizeof(h.magic));
+    h.ncaches = ncaches;
+    h.trace_len = strlen(trace_fn);
+    h.trace_size = traceSize(trace_fn);
+    h.offset = offset;
+    h.prev = prev;
+    h.accesses = resume.accesses;
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(trace_fn, 1, h.trace_len, fp);
+    padFile(fp);
+
+    for(int i = 0; i < ncaches; i++) {
+        cache_t* c = &caches[i];
+        checkpoint_cache_t cc = {
+            c->s, c->E, c->b, c->policy, c->write_mode, c->split_lines,
+#define SAVE(field) c->field,
+            CHECKPOINT_COUNTERS(SAVE)
+#undef SAVE
+            c->block_size
+        };
+        fwrite(&cc, sizeof(cc), 1, fp);
+        padFile(fp);
+        fwrite(c->block, 1, c->block_size, fp);
+    }
+
+    bool failed = ferror(fp);
+    if(fclose(fp) != 0 || failed || rename(tmp_fn, checkpoint_file) < 0) {
+        fprintf(stderr, "%s: %s\n", checkpoint_file, strerror(errno));
+        exit(1);
+    }
+    free(tmp_fn);
+}
+
+/*
+ * restoreCheckpoint - load the state and counters of the ncaches caches,
+ * which must be configured as they were, from the snapshot ckpt_fn. On
+ * the trace it was taken on the replay resumes where it stopped; on any
+ * other trace it starts at the beginning, warmed up, with zero counters.
+ */
+CSIM_INTERNAL void restoreCheckpoint(const char* ckpt_fn, cache_t* caches, int ncaches,
+                                     const char* trace_fn)
+{
+    struct stat st;
+    int fd = open(ckpt_fn, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", ckpt_fn, strerror(errno));
+        exit(1);
+    }
+    char* map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    size_t len = st.st_size, at = 0;
+
+    const checkpoint_header_t* h = (const checkpoint_header_t*)map;
+    if(map == MAP_FAILED || len < sizeof(*h) || memcmp(h->magic, CKPT_MAGIC, sizeof(h->magic)) != 0 ||
+       (int)h->ncaches != ncaches || len < sizeof(*h) + h->trace_len) {
+        fprintf(stderr, "%s: not a checkpoint of %d cache%s\n", ckpt_fn, ncaches,
+                ncaches == 1 ? "" : "s");
+        exit(1);
+    }
+    //a stream cannot be told apart from another, so only a file resumes
+    unsigned long long trace_size = traceSize(trace_fn);
+    bool same_trace = trace_size > 0 && h->trace_size == trace_size &&
+        h->trace_len == strlen(trace_fn) && memcmp(map + sizeof(*h), trace_fn, h->trace_len) == 0;
+    at = (sizeof(*h) + h->trace_len + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+
+    for(int i = 0; i < ncaches; i++) {
+        cache_t* c = &caches[i];
+        const checkpoint_cache_t* cc = (const checkpoint_cache_t*)(map + at);
+        at += (sizeof(*cc) + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+        if(at > len || cc->s != c->s || cc->E != c->E || cc->b != c->b ||
+           cc->policy != (int32_t)c->policy || cc->write_mode != c->write_mode ||
+           cc->split_lines != c->split_lines || cc->block_size != c->block_size ||
+           len - at < c->block_size) {
+            fprintf(stderr, "%s: cache %d was s:%d E:%d b:%d %s, not s:%d E:%d b:%d %s\n",
+                    ckpt_fn, i + 1, cc->s, cc->E, cc->b,
+                    cc->policy >= 0 && cc->policy < NUM_POLICIES ? policy_names[cc->policy] : "?",
+                    c->s, c->E, c->b, policy_names[c->policy]);
+            exit(1);
+        }
+        memcpy(c->block, map + at, c->block_size);
+        at += c->block_size;
+        if(same_trace) {
+#define LOAD(field) c->field = cc->field;
+            CHECKPOINT_COUNTERS(LOAD)
+#undef LOAD
+        } else {
+            c->clock = cc->clock;
+        }
+    }
+
+    if(same_trace) {
+        resume.offset = h->offset;
+        resume.prev = h->prev;
+        resume.accesses = h->accesses;
+    }
+    munmap(map, len);
+}
+
+/* Type: Batch queue
+ * Single producer, single consumer ring of decoded batches. A reader
+ * thread fills slot tail % nslots and publishes tail; the replay loop
+ * simulates slot head % nslots and publishes head once done with it.
+ */
+typedef struct batch_queue {
+    _Alignas(CACHE_ALIGN) atomic_long head;
+    _Alignas(CACHE_ALIGN) atomic_long tail;
+    _Alignas(CACHE_ALIGN) atomic_bool done;
+    int nslots;
+    trace_reader_t* reader;
+    access_batch_t* slots;
+} batch_queue_t;
+
+/* Type: Batch source
+ * The batches of a trace, decoded either in line by nextBatch() or up
+ * to readahead batches ahead by a reader thread, so reading and
+ * decoding overlap the simulation
+ */
+typedef struct batch_source {
+    trace_reader_t reader;
+    access_batch_t* batch;  /* in line: the one batch */
+    batch_queue_t* queue;   /* read ahead: NULL in line */
+    pthread_t thread;
+    long head;              /* read ahead: slot handed out last */
+    bool holding;           /* read ahead: slot head not yet released */
+} batch_source_t;
+
+/*
+ * readAhead - reader thread body: decode batches into every free slot
+ * of the queue until the trace ends
+ */
+CSIM_INTERNAL void* readAhead(void* arg)
+{
+    batch_queue_t* q = arg;
+    long tail = 0;
+
+    for(;;) {
+        while(tail - atomic_load_explicit(&q->head, memory_order_acquire) == q->nslots)
+            sched_yield();
+        if(fillBatch(q->reader, &q->slots[tail % q->nslots]) == 0)
+            break;
+        atomic_store_explicit(&q->tail, ++tail, memory_order_release);
+    }
+    atomic_store_explicit(&q->done, true, memory_order_release);
+    return NULL;
+}
+
+/*
+ * openBatches - open trace_fn and start decoding it, on a reader thread
+ * if readahead asks for one
+ */
+CSIM_INTERNAL void openBatches(batch_source_t* src, char* trace_fn)
+{
+    memset(src, 0, sizeof(*src));
+    openTrace(&src->reader, trace_fn);
+    if(resume.offset)
+        seekTrace(&src->reader, resume.offset, resume.prev);
+
+    //a profile needs the phases one after the other, on this thread, and
+    //-v echoes each record as decoded, which must not run ahead of the
+    //output of the simulation
+    if(readahead <= 0 || profile.enabled || verbosity) {
+        src->batch = malloc(sizeof(access_batch_t));
+        if(!src->batch) {
+            fprintf(stderr, "replayTrace: %s\n", strerror(errno));
+            exit(1);
+        }
+        return;
+    }
+
+    batch_queue_t* q = aligned_alloc(CACHE_ALIGN, sizeof(batch_queue_t));
+    access_batch_t* slots = malloc(readahead * sizeof(access_batch_t));
+    if(!q || !slots) {
+        fprintf(stderr, "replayTrace: %s\n", strerror(errno));
+        exit(1);
+    }
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->done, false);
+    q->nslots = readahead;
+    q->reader = &src->reader;
+    q->slots = slots;
+    src->queue = q;
+    if(pthread_create(&src->thread, NULL, readAhead, q) != 0) {
+        fprintf(stderr, "replayTrace: cannot start reader thread\n");
+        exit(1);
+    }
+}
+
+/*
+ * nextBatch - the next batch of the trace, or NULL at its end. The batch
+ * stays valid until the next call.
+ */
+CSIM_INTERNAL const access_batch_t* nextBatch(batch_source_t* src)
+{
+    if(!src->queue)
+        return fillBatch(&src->reader, src->batch) > 0 ? src->batch : NULL;
+
+    batch_queue_t* q = src->queue;
+    if(src->holding) {
+        atomic_store_explicit(&q->head, ++src->head, memory_order_release);
+        src->holding = false;
+    }
+    for(;;) {
+        if(src->head < atomic_load_explicit(&q->tail, memory_order_acquire)) {
+            src->holding = true;
+            return &q->slots[src->head % q->nslots];
+        }
+        if(atomic_load_explicit(&q->done, memory_order_acquire) &&
+           src->head == atomic_load_explicit(&q->tail, memory_order_acquire))
+            return NULL;
+        sched_yield();
+    }
+}
+
+/*
+ * closeBatches - wait for the reader thread, if any, and close the trace;
+ * nextBatch() must have returned NULL
+ */
+CSIM_INTERNAL void closeBatches(batch_source_t* src)
+{
+    if(src->queue) {
+        pthread_join(src->thread, NULL);
+        free(src->queue->slots);
+        free(src->queue);
+    }
+    free(src->batch);
+    closeTrace(&src->reader);
+}
+
+/* Batches the reader thread decodes ahead unless --readahead says otherwise */
+#define READAHEAD_BATCHES 4
+
+/* 
+ * replayTrace - replays the given trace file against the cache 
+ * reads the input trace file line by line
+ * extracts the type of each memory access : L/S/M
+ * one "L" as a load i.e. 1 memory access
+ * one "S" as a store i.e. 1 memory access
+ * one "M" as a load followed by a store i.e. 2 memory accesses 
+ * every access is fed to each of the ncaches caches, so a sweep over many
+ * geometries decodes the trace only once; with more than one thread the
+ * caches of a sweep are spread over worker threads, and the sets of a
+ * single cache without a prefetcher or breakdown are sharded over them
+ */
+CSIM_INTERNAL void replayTrace(char* trace_fn, cache_t* caches, int ncaches)
+{
+    profileSwitch(PHASE_PARSE);
+
+    //a profile needs the phases one after the other, checkpoints need
+    //the caches at rest between batches and intervals print in order,
+    //all on this thread
+    int nworkers = nthreads < ncaches ? nthreads : ncaches;
+    bool serial = profile.enabled || checkpoint_every || caches[0].interval;
+    bool parallel = nworkers > 1 && !serial;
+    bool sharded = !parallel && ncaches == 1 && nthreads > 1 && caches[0].S > 1 &&
+        !caches[0].prefetcher && !caches[0].detail && !caches[0].sampling && !caches[0].tlb &&
+        !serial;
+
+    if(parallel || sharded) {
+        trace_reader_t reader;
+        openTrace(&reader, trace_fn);
+        if(resume.offset)
+            seekTrace(&reader, resume.offset, resume.prev);
+        if(parallel)
+            replayParallel(&reader, caches, ncaches, nworkers);
+        else
+            replaySharded(&reader, &caches[0],
+                          (size_t)nthreads < caches[0].S ? nthreads : (int)caches[0].S);
+        closeTrace(&reader);
+    } else {
+        batch_source_t src;
+        cache_t** all = malloc(ncaches * sizeof(cache_t*));
+        if(!all) {
+            fprintf(stderr, "replayTrace: %s\n", strerror(errno));
+            exit(1);
+        }
+        for(int i = 0; i < ncaches; i++)
+            all[i] = &caches[i];
+        unsigned long long due = resume.accesses + checkpoint_every;
+        unsigned long long end_offset = resume.offset;
+        mem_addr_t end_prev = resume.prev;
+        openBatches(&src, trace_fn);
+        for(const access_batch_t* batch; (batch = nextBatch(&src)); ) {
+            profileSwitch(PHASE_SIMULATE);
+            simulateBatch(all, ncaches, batch);
+            profile.accesses += batch->n;
+            resume.accesses += batch->n;
+            end_offset = batch->end_offset;
+            end_prev = batch->end_prev;
+            if(checkpoint_every && resume.accesses >= due) {
+                writeCheckpoint(caches, ncaches, trace_fn, end_offset, end_prev);
+                due = resume.accesses + checkpoint_every;
+            }
+            profileSwitch(PHASE_PARSE);
+        }
+        //a last snapshot of the fully warmed caches
+        if(checkpoint_every)
+            writeCheckpoint(caches, ncaches, trace_fn, end_offset, end_prev);
+        closeBatches(&src);
+        free(all);
+    }
+
+    profileSwitch(NUM_PHASES);
+}
+
+/*
+ * replayStackDistance - replay the trace through every stack distance
+ * engine in a single pass
+ */
+CSIM_INTERNAL void replayStackDistance(char* trace_fn, sd_engine_t* engines, int nengines)
+{
+    batch_source_t src;
+
+    profileSwitch(PHASE_PARSE);
+    openBatches(&src, trace_fn);
+    for(const access_batch_t* batch; (batch = nextBatch(&src)); ) {
+        profileSwitch(PHASE_SIMULATE);
+        for(int i = 0; i < nengines; i++)
+            for(int j = 0; j < batch->n; j++) {
+                mem_addr_t a;
+                unsigned int len;
+                for(pieces_t p = piecesOf(batch->addr[j], batch->len[j], engines[i].b, split_lines,
+                                          NULL); takePiece(&p, &a, &len); )
+                    sdAccess(&engines[i], a);
+            }
+        profile.accesses += batch->n;
+        profileSwitch(PHASE_PARSE);
+    }
+    closeBatches(&src);
+    profileSwitch(NUM_PHASES);
+}
+
+/*
+ * replayHierarchy - replay the trace through a cache hierarchy
+ */
+CSIM_INTERNAL void replayHierarchy(char* trace_fn, level_t* levels, int nlevels)
+{
+    batch_source_t src;
+
+    profileSwitch(PHASE_PARSE);
+    openBatches(&src, trace_fn);
+    //every level has the same block size, so one split serves them all
+    cache_t* l1 = &levels[0].cache;
+    for(const access_batch_t* batch; (batch = nextBatch(&src)); ) {
+        profileSwitch(PHASE_SIMULATE);
+        for(int j = 0; j < batch->n; j++) {
+            mem_addr_t a;
+            unsigned int len;
+            for(pieces_t p = piecesOf(batch->addr[j], batch->len[j], l1->b, l1->split_lines,
+                                      &l1->line_crossing_count); takePiece(&p, &a, &len); )
+                accessHierarchy(levels, nlevels, batch->op[j], a);
+        }
+        profile.accesses += batch->n;
+        profileSwitch(PHASE_PARSE);
+    }
+    closeBatches(&src);
+    profileSwitch(NUM_PHASES);
+}
+
+/*
+ * replayCoherent - replay a thread tagged trace through ncores private
+ * caches, the accesses of thread t going to core t % ncores
+ */
+CSIM_INTERNAL void replayCoherent(char* trace_fn, core_t* cores, int ncores, protocol_t protocol,
+                                  block_map_t* shared)
+{
+    batch_source_t src;
+
+    profileSwitch(PHASE_PARSE);
+    openBatches(&src, trace_fn);
+    for(const access_batch_t* batch; (batch = nextBatch(&src)); ) {
+        profileSwitch(PHASE_SIMULATE);
+        for(int j = 0; j < batch->n; j++) {
+            int c = batch->tid[j] % ncores;
+            cache_t* cache = &cores[c].cache;
+            mem_addr_t a;
+            unsigned int len;
+            for(pieces_t p = piecesOf(batch->addr[j], batch->len[j], cache->b, cache->split_lines,
+                                      &cache->line_crossing_count); takePiece(&p, &a, &len); )
+                accessCoherent(cores, ncores, c, batch->op[j], a, len, protocol, shared);
+        }
+        profile.accesses += batch->n;
+        profileSwitch(PHASE_PARSE);
+    }
+    closeBatches(&src);
+    profileSwitch(NUM_PHASES);
+}
+
+/* Type: Live capture
+ * A program run under --perf-mem, whose loads and stores the CPU samples
+ * with the precise mem-loads and mem-stores events (PEBS on Intel), as
+ * perf mem does. Only one in period accesses of each kind is seen, so
+ * the caches simulate that sampled stream, and its hits and misses are
+ * not those of the program's full stream. The events are not inherited,
+ * so only the program's first thread is sampled, not the threads and
+ * children it starts. Both events write into one ring buffer of
+ * LIVE_PAGES pages, so the samples arrive in order.
+ */
+#define LIVE_PAGES 512
+#define LIVE_PERIOD 100
+#define LIVE_POLL_MS 10
+
+typedef struct live_capture {
+    pid_t child;
+    int fds[2];              /* the mem-loads and mem-stores events */
+    uint64_t ids[2];         /* the sample ids of each */
+    unsigned long long samples[2];
+    unsigned long long lost; /* samples the kernel dropped */
+    void* ring;              /* control page, then the data pages */
+    size_t ring_size;
+} live_capture_t;
+
+#ifdef __linux__
+/* PMUs whose events/ may hold mem-loads and mem-stores, in the order tried */
+static const char* live_pmus[] = { "cpu", "cpu_core" };
+
+/*
+ * readSysfs - the first line of /sys/bus/event_source/devices/pmu/file
+ * into buf; false if there is none
+ */
+static bool readSysfs(const char* pmu, const char* file, char* buf, size_t size)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/%s", pmu, file);
+    FILE* fp = fopen(path, "r");
+    if(!fp)
+        return false;
+    bool ok = fgets(buf, size, fp) != NULL;
+    fclose(fp);
+    buf[strcspn(buf, "\n")] = '\0';
+    return ok;
+}
+
+/*
+ * setTerm - store val in the bits of attr that the term of pmu covers,
+ * as described by its format file, e.g. "config1:0-15"
+ */
+static bool setTerm(const char* pmu, const char* term, uint64_t val, struct perf_event_attr* attr)
+{
+    char file[64], format[128];
+    snprintf(file, sizeof(file), "format/%s", term);
+    if(!readSysfs(pmu, file, format, sizeof(format)))
+        return false;
+
+    char* bits = strchr(format, ':');
+    if(!bits)
+        return false;
+    *bits++ = '\0';
+    __u64* config = strcmp(format, "config") == 0 ? &attr->config :
+        strcmp(format, "config1") == 0 ? &attr->config1 :
+        strcmp(format, "config2") == 0 ? &attr->config2 : NULL;
+    if(!config)
+        return false;
+
+    //the value fills the listed bit ranges lowest first
+    for(char* range = strtok(bits, ","); range; range = strtok(NULL, ",")) {
+        int lo, hi;
+        if(sscanf(range, "%d-%d", &lo, &hi) != 2)
+            hi = lo = atoi(range);
+        for(int bit = lo; bit <= hi && bit < 64; bit++, val >>= 1)
+            *config |= (val & 1) << bit;
+    }
+    return true;
+}
+
+/*
+ * findEvent - fill in attr for the named event of the first PMU that has
+ * one, such as "event=0xcd,umask=0x1,ldlat=3"; false if none does
+ */
+static bool findEvent(const char* name, struct perf_event_attr* attr)
+{
+    for(size_t i = 0; i < sizeof(live_pmus) / sizeof(live_pmus[0]); i++) {
+        char file[64], spec[256], type[32];
+        snprintf(file, sizeof(file), "events/%s", name);
+        if(!readSysfs(live_pmus[i], "type", type, sizeof(type)) ||
+           !readSysfs(live_pmus[i], file, spec, sizeof(spec)))
+            continue;
+
+        attr->type = atoi(type);
+        attr->config = attr->config1 = attr->config2 = 0;
+        bool ok = true;
+        char* save;
+        for(char* term = strtok_r(spec, ",", &save); term && ok; term = strtok_r(NULL, ",", &save)) {
+            char* eq = strchr(term, '=');
+            uint64_t val = 1;
+            if(eq) {
+                *eq = '\0';
+                val = strtoull(eq + 1, NULL, 0);
+            }
+            ok = setTerm(live_pmus[i], term, val, attr);
+        }
+        if(ok)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * openLiveEvent - open the named sampling event on pid, counting from
+ * its exec, with the most precise skid the CPU allows; -1 if it cannot
+ */
+static int openLiveEvent(const char* name, pid_t pid, unsigned long long period)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    if(!findEvent(name, &attr)) {
+        errno = ENOENT;
+        return -1;
+    }
+    attr.sample_period = period;
+    attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_ADDR;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.watermark = 1;
+    attr.wakeup_watermark = LIVE_PAGES * sysconf(_SC_PAGESIZE) / 4;
+
+    int fd = -1;
+    for(int precise = 3; precise > 0 && fd < 0; precise--) {
+        attr.precise_ip = precise;
+        fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+/*
+ * startLive - start the program argv stopped before its exec, attach the
+ * events to it and let it run
+ */
+CSIM_INTERNAL void startLive(live_capture_t* lc, char** argv, unsigned long long period)
+{
+    static const char* events[2] = { "mem-loads", "mem-stores" };
+    int go[2];
+    memset(lc, 0, sizeof(*lc));
+    if(pipe(go) < 0) {
+        fprintf(stderr, "startLive: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    //the child waits for its events before it execs, which enables them
+    lc->child = fork();
+    if(lc->child < 0) {
+        fprintf(stderr, "startLive: %s\n", strerror(errno));
+        exit(1);
+    }
+    if(lc->child == 0) {
+        char c;
+        close(go[1]);
+        if(read(go[0], &c, 1) != 1)
+            _exit(127);
+        close(go[0]);
+        execvp(argv[0], argv);
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    close(go[0]);
+
+    for(int i = 0; i < 2; i++) {
+        lc->fds[i] = openLiveEvent(events[i], lc->child, period);
+        if(lc->fds[i] < 0 || ioctl(lc->fds[i], PERF_EVENT_IOC_ID, &lc->ids[i]) < 0) {
+            fprintf(stderr, "startLive: cannot sample %s: %s\n", events[i],
+                    errno == ENOENT ? "this CPU has no such event" : strerror(errno));
+            kill(lc->child, SIGKILL);
+            waitpid(lc->child, NULL, 0);
+            exit(1);
+        }
+    }
+
+    lc->ring_size = (1 + LIVE_PAGES) * sysconf(_SC_PAGESIZE);
+    lc->ring = mmap(NULL, lc->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, lc->fds[0], 0);
+    if(lc->ring == MAP_FAILED || ioctl(lc->fds[1], PERF_EVENT_IOC_SET_OUTPUT, lc->fds[0]) < 0) {
+        fprintf(stderr, "startLive: %s\n", strerror(errno));
+        kill(lc->child, SIGKILL);
+        waitpid(lc->child, NULL, 0);
+        exit(1);
+    }
+
+    if(write(go[1], "", 1) != 1) {
+        fprintf(stderr, "startLive: %s\n", strerror(errno));
+        exit(1);
+    }
+    close(go[1]);
+}
+
+/*
+ * drainLive - move the samples in the ring buffer to batch, handing each
+ * full batch to the caches
+ */
+static void drainLive(live_capture_t* lc, access_batch_t* batch, cache_t** caches, int ncaches)
+{
+    struct perf_event_mmap_page* meta = lc->ring;
+    const char* data = (const char*)lc->ring + meta->data_offset;
+    uint64_t size = meta->data_size;
+    uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = meta->data_tail;
+
+    while(tail < head) {
+        //records are 8-byte aligned, but may wrap around the end
+        struct perf_event_header hdr;
+        uint64_t rec[4] = { 0 };
+        memcpy(&hdr, data + tail % size, sizeof(hdr));
+        size_t len = hdr.size < sizeof(rec) ? hdr.size : sizeof(rec);
+        for(size_t i = 0; i < len; i += 8)
+            memcpy((char*)rec + i, data + (tail + i) % size, 8);
+        if(hdr.size == 0)
+            break;
+        tail += hdr.size;
+
+        if(hdr.type == PERF_RECORD_LOST) {
+            lc->lost += rec[2];
+        } else if(hdr.type == PERF_RECORD_SAMPLE && rec[2]) {
+            bool store = rec[1] == lc->ids[1];
+            lc->samples[store]++;
+            if(verbosity)
+                printf("%c %llx,1 \n", store ? 'S' : 'L', (mem_addr_t)rec[2]);
+            batch->op[batch->n] = store ? 'S' : 'L';
+            batch->addr[batch->n] = rec[2];
+            batch->len[batch->n++] = 1;
+            if(batch->n == BATCH_SIZE) {
+                simulateBatch(caches, ncaches, batch);
+                batch->n = 0;
+            }
+        }
+    }
+    __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+#endif
+
+/*
+ * replayLive - run the program argv under --perf-mem and feed the
+ * sampled accesses to each of the ncaches caches until it exits
+ */
+CSIM_INTERNAL void replayLive(char** argv, cache_t* caches, int ncaches, unsigned long long period)
+{
+#ifdef __linux__
+    live_capture_t lc;
+    access_batch_t* batch = malloc(sizeof(access_batch_t));
+    cache_t** all = malloc(ncaches * sizeof(cache_t*));
+    if(!batch || !all) {
+        fprintf(stderr, "replayLive: %s\n", strerror(errno));
+        exit(1);
+    }
+    for(int i = 0; i < ncaches; i++)
+        all[i] = &caches[i];
+    batch->n = 0;
+
+    startLive(&lc, argv, period);
+    int status;
+    for(bool running = true; running; ) {
+        running = waitpid(lc.child, &status, WNOHANG) == 0;
+        drainLive(&lc, batch, all, ncaches);
+        if(running) {
+            struct pollfd pfd = { lc.fds[0], POLLIN, 0 };
+            poll(&pfd, 1, LIVE_POLL_MS);
+        }
+    }
+    if(batch->n)
+        simulateBatch(all, ncaches, batch);
+
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "replayLive: %s exited with %s %d\n", argv[0],
+                WIFEXITED(status) ? "status" : "signal",
+                WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+    printf("sampled-loads:%llu sampled-stores:%llu period:%llu lost:%llu "
+           "(first thread only; hits and misses are of the 1 in %llu sample, not the program)\n",
+           lc.samples[0], lc.samples[1], period, lc.lost, period);
+
+    munmap(lc.ring, lc.ring_size);
+    close(lc.fds[0]);
+    close(lc.fds[1]);
+    free(batch);
+    free(all);
+#else
+    (void)argv; (void)caches; (void)ncaches; (void)period;
+    fprintf(stderr, "replayLive: --perf-mem needs Linux perf events\n");
+    exit(1);
+#endif
+}
+
+/*
+ * convertTrace - write every data access of in_fn to out_fn in the
+ * compact binary format, so later runs skip text parsing; the threads
+ * of a tagged trace are kept for --cores
+ */
+CSIM_INTERNAL void convertTrace(char* in_fn, char* out_fn)
+{
+    trace_reader_t reader;
+    char op;
+    mem_addr_t addr, prev = 0;
+    unsigned int len, tid = 0;
+    unsigned char rec[CTR_MAX_RECORD];
+
+    FILE* out_fp = fopen(out_fn, "wb");
+    if(!out_fp) {
+        fprintf(stderr, "%s: %s\n", out_fn, strerror(errno));
+        exit(1);
+    }
+    fwrite(CTR_MAGIC, 1, CTR_MAGIC_LEN, out_fp);
+
+    openTrace(&reader, in_fn);
+    while(nextRecord(&reader, &op, &addr, &len)) {
+        if(reader.tid != tid) {
+            tid = reader.tid;
+            rec[0] = CTR_OP_THREAD;
+            fwrite(rec, 1, 1 + putVarint(rec + 1, tid), out_fp);
+        }
+        bool neg = addr < prev;
+        int n = 1;
+        rec[0] = (op == 'L' ? 0 : op == 'S' ? 1 : 2) | neg << 2;
+        n += putVarint(rec + n, neg ? prev - addr : addr - prev);
+        if(len < CTR_SIZE_ESC) {
+            rec[0] |= len << 3;
+        } else {
+            rec[0] |= CTR_SIZE_ESC << 3;
+            n += putVarint(rec + n, len);
+        }
+        fwrite(rec, 1, n, out_fp);
+        prev = addr;
+    }
+    closeTrace(&reader);
+
+    if(fclose(out_fp) != 0) {
+        fprintf(stderr, "%s: %s\n", out_fn, strerror(errno));
+        exit(1);
+    }
+}
+
+/* Type: Workload
+ * Synthetic access patterns --bench generates in memory
+ *   seq      8-byte loads walking a 256 MiB array
+ *   stride   loads 4 KiB + 64 bytes apart, so each touches a new block
+ *   rows     the stores of cache2Drows.c, row by row over int[3000][500]
+ *   cols     the stores of cache2Dcols.c, column by column
+ *   uniform  uniformly random 8-byte loads and stores over 64 MiB
+ *   zipf     Zipfian (alpha BENCH_ZIPF_ALPHA) loads of BENCH_ITEMS blocks
+ *   chase    a pointer chase through a random cycle of BENCH_ITEMS blocks
+ */
+typedef enum workload {
+    WORKLOAD_SEQ,
+    WORKLOAD_STRIDE,
+    WORKLOAD_ROWS,
+    WORKLOAD_COLS,
+    WORKLOAD_UNIFORM,
+    WORKLOAD_ZIPF,
+    WORKLOAD_CHASE,
+    NUM_WORKLOADS
+} workload_t;
+
+CSIM_INTERNAL const char* workload_names[NUM_WORKLOADS] = {
+    "seq", "stride", "rows", "cols", "uniform", "zipf", "chase"
+};
+
+/* Where the synthetic data lives, and its shapes */
+#define BENCH_BASE 0x10000000ULL
+#define BENCH_ROWS 3000
+#define BENCH_COLS 500
+#define BENCH_ITEMS (1 << 20)
+#define BENCH_ZIPF_ALPHA 0.99
+
+/* Accesses per generated trace unless --bench-accesses says otherwise */
+#define BENCH_ACCESSES (1 << 22)
+
+/*
+ * benchAlloc - malloc that exits on failure
+ */
+static void* benchAlloc(size_t size)
+{
+    void* p = malloc(size);
+    if(!p) {
+        fprintf(stderr, "bench: %s\n", strerror(errno));
+        exit(1);
+    }
+    return p;
+}
+
+/* Type: Workload generator
+ * The state of one generated trace, handed out a batch at a time like
+ * the accesses of a trace file
+ */
+typedef struct workload_gen {
+    workload_t w;
+    uint64_t rng;
+    uint64_t k;         /* accesses generated so far */
+    double* cdf;        /* zipf: cumulative popularity of each rank */
+    uint32_t* next;     /* chase: the block each block points to */
+    uint32_t node;      /* chase: the block to access next */
+} workload_gen_t;
+
+/*
+ * initWorkload - start generating workload w; the same w always gives
+ * the same trace
+ */
+CSIM_INTERNAL void initWorkload(workload_gen_t* gen, workload_t w)
+{
+    memset(gen, 0, sizeof(*gen));
+    gen->w = w;
+    gen->rng = 0x2545f4914f6cdd1dULL;
+
+    if(w == WORKLOAD_ZIPF) {
+        //cumulative popularity of each rank, for inverse transform sampling
+        gen->cdf = benchAlloc(BENCH_ITEMS * sizeof(double));
+        double sum = 0;
+        for(int i = 0; i < BENCH_ITEMS; i++)
+            gen->cdf[i] = sum += 1.0 / pow(i + 1, BENCH_ZIPF_ALPHA);
+        for(int i = 0; i < BENCH_ITEMS; i++)
+            gen->cdf[i] /= sum;
+    } else if(w == WORKLOAD_CHASE) {
+        //Sattolo's shuffle leaves a single cycle through every block
+        gen->next = benchAlloc(BENCH_ITEMS * sizeof(uint32_t));
+        for(uint32_t i = 0; i < BENCH_ITEMS; i++)
+            gen->next[i] = i;
+        for(uint32_t i = BENCH_ITEMS - 1; i > 0; i--) {
+            uint32_t j = nextRandom(&gen->rng) % i;
+            uint32_t t = gen->next[i];
+            gen->next[i] = gen->next[j];
+            gen->next[j] = t;
+        }
+    }
+}
+
+/*
+ * freeWorkload - free what initWorkload() allocated
+ */
+CSIM_INTERNAL void freeWorkload(workload_gen_t* gen)
+{
+    free(gen->cdf);
+    free(gen->next);
+}
+
+/*
+ * fillWorkload - generate the next n <= BATCH_SIZE accesses into batch.
+ * Returns the number of accesses generated.
+ */
+CSIM_INTERNAL int fillWorkload(workload_gen_t* gen, access_batch_t* batch, int n)
+{
+    for(int i = 0; i < n; i++) {
+        uint64_t k = gen->k++;
+        char op = 'L';
+        unsigned int len = 8;
+        mem_addr_t addr = BENCH_BASE;
+        switch(gen->w) {
+        case WORKLOAD_SEQ:
+            addr += k * 8 & ((1ULL << 28) - 1);
+            break;
+        case WORKLOAD_STRIDE:
+            addr += k * 4160 % (1ULL << 28);
+            break;
+        case WORKLOAD_ROWS:
+        case WORKLOAD_COLS: {
+            k %= BENCH_ROWS * BENCH_COLS;
+            uint64_t row = gen->w == WORKLOAD_ROWS ? k / BENCH_COLS : k % BENCH_ROWS;
+            uint64_t col = gen->w == WORKLOAD_ROWS ? k % BENCH_COLS : k / BENCH_ROWS;
+            op = 'S';
+            len = sizeof(int);
+            addr += (row * BENCH_COLS + col) * sizeof(int);
+            break;
+        }
+        case WORKLOAD_UNIFORM: {
+            uint64_t x = nextRandom(&gen->rng);
+            op = x >> 62 ? 'L' : 'S';
+            addr += x & ((1ULL << 26) - 8);
+            break;
+        }
+        case WORKLOAD_ZIPF: {
+            double u = (nextRandom(&gen->rng) >> 11) * 0x1p-53;
+            int lo = 0, hi = BENCH_ITEMS - 1;
+            while(lo < hi) {
+                int mid = (lo + hi) / 2;
+                if(gen->cdf[mid] < u)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            //scatter the ranks so the hot blocks do not share a few sets
+            addr += ((uint64_t)lo * 0x9e3779b1 & (BENCH_ITEMS - 1)) * 64;
+            break;
+        }
+        case WORKLOAD_CHASE:
+            addr += (uint64_t)gen->node * 64;
+            gen->node = gen->next[gen->node];
+            break;
+        default:
+            break;
+        }
+        batch->op[i] = op;
+        batch->addr[i] = addr;
+        batch->len[i] = len;
+    }
+    return batch->n = n;
+}
+
+/*
+ * runBench - generate n accesses of every selected workload and time
+ * their simulation by a cache of geometry g and write_mode for every
+ * tag probe and every selected policy, printing one line per run
+ */
+CSIM_INTERNAL void runBench(const bool* workloads, const bool* policies, int n, geometry_t g,
+                            int write_mode)
+{
+    //the whole trace is generated up front, outside the timed runs
+    int nbatches = (n + BATCH_SIZE - 1) / BATCH_SIZE;
+    access_batch_t* batches = benchAlloc(nbatches * sizeof(access_batch_t));
+    probe_fn fns[MAX_PROBES];
+    const char* names[MAX_PROBES];
+    int nprobes = listProbes(fns, names);
+
+    for(workload_t w = 0; w < NUM_WORKLOADS; w++) {
+        if(!workloads[w])
+            continue;
+        workload_gen_t gen;
+        initWorkload(&gen, w);
+        for(int i = 0; i < nbatches; i++)
+            fillWorkload(&gen, &batches[i], n - i * BATCH_SIZE < BATCH_SIZE ?
+                         n - i * BATCH_SIZE : BATCH_SIZE);
+        freeWorkload(&gen);
+
+        for(int i = 0; i < nprobes; i++)
+            for(policy_t p = 0; p < NUM_POLICIES; p++) {
+                if(!policies[p])
+                    continue;
+                cache_t cache;
+                cache_t* all = &cache;
+                probe = fns[i];
+                initCache(&cache, g.s, g.E, g.b, p, write_mode);
+                cache.split_lines = split_lines;
+
+                double start = wallClock();
+                for(int j = 0; j < nbatches; j++)
+                    simulateBatch(&all, 1, &batches[j]);
+                double seconds = wallClock() - start;
+
+                printf("workload:%s probe:%s policy:%s accesses:%d hits:%llu misses:%llu "
+                       "seconds:%.6f accesses/s:%.0f\n",
+                       workload_names[w], names[i], policy_names[p], n,
+                       cache.hit_count, cache.miss_count, seconds,
+                       seconds > 0 ? n / seconds : 0.0);
+                freeCache(&cache);
+            }
+    }
+    free(batches);
+}
+/*
+ * parseList - parse a comma separated list of numbers and lo-hi ranges
+ * into vals (at most max of them). Returns the count, or -1 if the list
+ * is malformed or too long.
+ */
+CSIM_INTERNAL int parseList(const char* list, int* vals, int max)
+{
+    int n = 0;
+    const char* p = list;
+
+    for(;;) {
+        char* end;
+        long lo = strtol(p, &end, 10);
+        long hi = lo;
+        if(end == p)
+            return -1;
+        if(*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if(end == p || hi < lo)
+                return -1;
+        }
+        for(long v = lo; v <= hi; v++) {
+            if(n == max)
+                return -1;
+            vals[n++] = v;
+        }
+        if(*end == ':' || *end == '\0')
+            return n;
+        if(*end != ',')
+            return -1;
+        p = end + 1;
+    }
+}
+
+/*
+ * addSweep - append every geometry described by spec to the sweep
+ * (*sweep, *nsweep). spec is "s:E:b" where each field is a list accepted
+ * by parseList(), and the geometries are the cross product of the lists.
+ */
+CSIM_INTERNAL void addSweep(geometry_t** sweep, int* nsweep, const char* spec)
+{
+    enum { MAX_VALS = 256 };
+    int vals[3][MAX_VALS];
+    int counts[3];
+    const char* field = spec;
+
+    for(int f = 0; f < 3; f++) {
+        counts[f] = parseList(field, vals[f], MAX_VALS);
+        field = strchr(field, ':');
+        if(counts[f] < 0 || (f < 2) != (field != NULL)) {
+            fprintf(stderr, "bad sweep \"%s\": expected s:E:b\n", spec);
+            exit(1);
+        }
+        if(field)
+            field++;
+    }
+
+    *sweep = realloc(*sweep, (*nsweep + counts[0] * counts[1] * counts[2]) * sizeof(geometry_t));
+    if(!*sweep) {
+        fprintf(stderr, "addSweep: %s\n", strerror(errno));
+        exit(1);
+    }
+    for(int i = 0; i < counts[0]; i++)
+        for(int j = 0; j < counts[1]; j++)
+            for(int k = 0; k < counts[2]; k++) {
+                geometry_t g = { vals[0][i], vals[1][j], vals[2][k] };
+                if(g.s < 0 || g.E < 1 || g.b < 1 || g.s + g.b >= 64) {
+                    fprintf(stderr, "bad sweep \"%s\": invalid geometry s=%d E=%d b=%d\n",
+                            spec, g.s, g.E, g.b);
+                    exit(1);
+                }
+                (*sweep)[(*nsweep)++] = g;
+            }
+}
+
+/*
+ * addLevel - append the level described by spec to the hierarchy
+ * (*levels, *nlevels). spec is "s:E:b" optionally followed by ":policy"
+ * and/or ":inclusion" (nine, the default, inclusive or exclusive).
+ * Every level must use the same block size.
+ */
+CSIM_INTERNAL void addLevel(level_t** levels, int* nlevels, const char* spec, policy_t policy)
+{
+    int geom[3];
+    const char* p = spec;
+    char* end;
+    inclusion_t inclusion = INCLUSION_NINE;
+
+    for(int f = 0; f < 3; f++) {
+        geom[f] = strtol(p, &end, 10);
+        if(end == p || (f < 2 && *end != ':')) {
+            fprintf(stderr, "bad level \"%s\": expected s:E:b[:policy][:inclusion]\n", spec);
+            exit(1);
+        }
+        p = end + 1;
+    }
+
+    //the optional fields, in either order
+    while(*end == ':') {
+        const char* name = end + 1;
+        size_t len = strcspn(name, ":");
+        int i;
+        end = (char*)name + len;
+        for(i = 0; i < NUM_POLICIES; i++)
+            if(strlen(policy_names[i]) == len && strncmp(name, policy_names[i], len) == 0)
+                break;
+        if(i < NUM_POLICIES) {
+            policy = i;
+            continue;
+        }
+        for(i = 0; i < NUM_INCLUSIONS; i++)
+            if(strlen(inclusion_names[i]) == len && strncmp(name, inclusion_names[i], len) == 0)
+                break;
+        if(i == NUM_INCLUSIONS) {
+            fprintf(stderr, "bad level \"%s\": unknown option %.*s\n", spec, (int)len, name);
+            exit(1);
+        }
+        inclusion = i;
+    }
+
+    if(*end != '\0' || geom[0] < 0 || geom[1] < 1 || geom[2] < 1 || geom[0] + geom[2] >= 64) {
+        fprintf(stderr, "bad level \"%s\": expected s:E:b[:policy][:inclusion]\n", spec);
+        exit(1);
+    }
+    if(*nlevels > 0 && (*levels)[0].cache.b != geom[2]) {
+        fprintf(stderr, "bad level \"%s\": every level needs the same block size\n", spec);
+        exit(1);
+    }
+
+    *levels = realloc(*levels, (*nlevels + 1) * sizeof(level_t));
+    if(!*levels) {
+        fprintf(stderr, "addLevel: %s\n", strerror(errno));
+        exit(1);
+    }
+    level_t* level = &(*levels)[(*nlevels)++];
+    initCache(&level->cache, geom[0], geom[1], geom[2], policy, 0);
+    level->inclusion = inclusion;
+    level->back_invalidations = 0;
+    level->memory_write_bytes = 0;
+}
+
+/*
+ * printUsage - Print usage info
+ */
+CSIM_INTERNAL void printUsage(char* argv[])
+{
+    printf("Usage: %s [-hvl] [-p <policy>] [-w <mode>] -s <num> -E <num> -b <num> -t <file>\n", argv[0]);
+    printf("       %s [-hv] [-p <policy>] [-j <num>] --sweep <s:E:b> [--sweep <s:E:b>...] -t <file>\n", argv[0]);
+    printf("       %s [-hv] [-p <policy>] --level <s:E:b> [--level <s:E:b>...] -t <file>\n", argv[0]);
+    printf("       %s [-hv] [-p <policy>] -s <num> -E <num> -b <num> --perf-mem -- <program> [<arg>...]\n", argv[0]);
+    printf("       %s [-hvl] [-p <policy>] [--coherence <protocol>] -s <num> -E <num> -b <num> --cores <num> -t <file>\n", argv[0]);
+    printf("       %s --convert <in> <out>\n", argv[0]);
+    printf("       %s [-p <policy>] [-s <num> -E <num> -b <num>] --bench <workload>\n", argv[0]);
+    printf("Options:\n");
+    printf("  -h         Print this help message.\n");
+    printf("  -v         Optional verbose flag.\n");
+    printf("  -s <num>   Number of set index bits.\n");
+    printf("  -E <num>   Number of lines per set.\n");
+    printf("  -b <num>   Number of block offset bits.\n");
+    printf("  -p <policy>  Replacement policy: lru (default), fifo, random, plru,\n");
+    printf("             srrip, brrip or lfu.\n");
+    printf("  -w <mode>  Write policy, wb (default) or wt, plus wa (default) or nwa,\n");
+    printf("             e.g. \"wt,nwa\"; also prints the write traffic.\n");
+    printf("  -l         Split accesses that cross a block boundary into one access\n");
+    printf("             per block touched, and count them.\n");
+    printf("  --prefetch <engine>[:<degree>]  Prefetch into the cache with next-line,\n");
+    printf("             stride or stream, <degree> blocks per trigger (default 1).\n");
+    printf("  --prefetch-latency <num>  Accesses before a prefetch fills (default 0).\n");
+    printf("  --tlb <entries>:<ways>[,<entries>:<ways>]  Translate every access through\n");
+    printf("             an L1 DTLB and optionally an STLB behind it, replacing by\n");
+    printf("             -p, and count their misses and the page walks.\n");
+    printf("  --page-size <size>  Page size of --tlb, e.g. 4k (default), 2m or 1g.\n");
+    printf("  --latency <hit>[,<hit>...]:<memory>[:<writeback>[:<walk>]]  Print the\n");
+    printf("             AMAT and stall cycles from the cycles of a lookup in each\n");
+    printf("             level, a miss to memory, a write to memory (a dirty block\n");
+    printf("             or a write-through store) and a page table read of a\n");
+    printf("             --tlb miss (default 0).\n");
+    printf("  --prefetch-overlap <fraction>  Share of the memory latency a late\n");
+    printf("             prefetch still hides for --latency (default 0).\n");
+    printf("  --detail   Also classify the misses as cold, capacity or conflict and\n");
+    printf("             print the sets and regions with the most misses.\n");
+    printf("  --top <num>  Rows of each --detail table (default 10).\n");
+    printf("  --region-bits <num>  Size of a --detail region, 2^<num> bytes (default 12).\n");
+    printf("  --ranges <file>[:<offset>]  Also charge the accesses and evictions of\n");
+    printf("             --detail to the named ranges of <file>, nm -S output or\n");
+    printf("             \"<start> <size> <name>\" lines, moved up by hex <offset>,\n");
+    printf("             and print the pairs of ranges that evict each other.\n");
+    printf("  -t <file>  Trace file (\"-\" reads standard input), text or binary; a\n");
+    printf("             gzip, zstd or xz compressed file is decompressed on the fly.\n");
+    printf("  --sweep <s:E:b>  Simulate every geometry in the cross product of the\n");
+    printf("             three comma separated lists of values or lo-hi ranges.\n");
+    printf("  -j <num>   Spread the sweep, or the sets of a single cache, over\n");
+    printf("             <num> worker threads.\n");
+    printf("  --level <s:E:b>[:<policy>][:<inclusion>]  Add a level to a cache\n");
+    printf("             hierarchy, starting at L1. <inclusion> is nine (default),\n");
+    printf("             inclusive or exclusive of the levels above.\n");
+    printf("  --cores <num>  Give every core a private -s/-E/-b cache kept coherent\n");
+    printf("             by snooping; thread t of a trace tagged \" L addr,len,t\"\n");
+    printf("             runs on core t %% <num>. Counts invalidations, coherence\n");
+    printf("             and false sharing misses; --top picks the lines shown.\n");
+    printf("  --coherence <protocol>  Protocol of --cores, mesi (default) or moesi.\n");
+    printf("  --stack-distance  Print the LRU miss curve for 1..E ways (the largest\n");
+    printf("             E of each s:b pair of a sweep) from a single pass.\n");
+    printf("  --output <file>  Also write the configuration, counters and timing to\n");
+    printf("             <file> (\"-\" is standard output, and the summary then\n");
+    printf("             goes to standard error).\n");
+    printf("  --format <fmt>  Format of --output, json (default) or csv; only json\n");
+    printf("             has the per-set and per-region tables of --detail.\n");
+    printf("  --results  Write hits, misses and evictions to .csim_results for the\n");
+    printf("             autograder.\n");
+    printf("  --bench <workload>[,<workload>...]  Time the simulation of generated\n");
+    printf("             seq, stride, rows, cols, uniform, zipf or chase (or all)\n");
+    printf("             traces for every tag probe and policy (-p picks one); the\n");
+    printf("             geometry defaults to -s 6 -E 8 -b 6.\n");
+    printf("  --bench-accesses <num>  Accesses per generated trace (default 4194304).\n");
+    printf("  --profile  Print the time, time per access and, where the kernel allows,\n");
+    printf("             the simulator's cycles, instructions and LLC misses spent\n");
+    printf("             parsing and simulating; replays on a single thread.\n");
+    printf("  --sample-sets <num>  Simulate about 1 in <num> sets and extrapolate the\n");
+    printf("             totals, with 95%% confidence intervals.\n");
+    printf("  --sample-time <window>:<period>[:<warmup>]  Of every <period> accesses\n");
+    printf("             simulate <warmup> (default <window>) to warm the cache up,\n");
+    printf("             then measure <window>, and extrapolate the same way.\n");
+    printf("  --checkpoint-every <num>  Snapshot the caches and the trace position to\n");
+    printf("             the checkpoint file every <num> accesses and at the end.\n");
+    printf("  --checkpoint-file <file>  Where snapshots go (default csim.ckpt).\n");
+    printf("  --restore <file>  Start from a snapshot of the same configuration:\n");
+    printf("             resume its replay on the same trace file, or start another\n");
+    printf("             trace or any stream with its warm caches and zero counters.\n");
+    printf("  --interval <num>  Print the hits, misses, evictions and working set\n");
+    printf("             (distinct blocks touched) of every <num> accesses.\n");
+    printf("  --readahead <num>  Decode up to <num> batches of the trace ahead on a\n");
+    printf("             reader thread, 0 for none (default 4 with several CPUs;\n");
+    printf("             always 0 with -v or --profile).\n");
+    printf("  --perf-mem  Run <program> and simulate the loads and stores the CPU's\n");
+    printf("             mem-loads and mem-stores events sample, instead of a trace.\n");
+    printf("             Only its first thread is sampled, and the hits and misses\n");
+    printf("             are those of the 1 in --perf-period sampled accesses, not\n");
+    printf("             of the program's full access stream.\n");
+    printf("  --perf-period <num>  Sample 1 in <num> loads and stores (default 100).\n");
+    printf("  --convert <in> <out>  Convert trace <in> to the binary format.\n");
+    printf("\nExamples:\n");
+    printf("  linux>  %s -s 4 -E 1 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s -v -s 8 -E 2 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s -p plru -s 4 -E 8 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s -w wt,nwa -s 4 -E 2 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s --prefetch stride:2 -s 4 -E 2 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s --tlb 64:4,1536:12 --page-size 2m -s 6 -E 8 -b 6 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s --detail --top 4 -s 4 -E 1 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  nm -S cache2Dcols > syms; %s --ranges syms -s 4 -E 1 -b 4 -t cols.trace\n", argv[0]);
+    printf("  linux>  %s -j 8 --sweep 4-8:1,2,4:4 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s --level 6:8:6 --level 10:8:6 --level 13:16:6:inclusive -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s --stack-distance -s 4 -E 16 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s --latency 4,14,50:200:20 --level 6:8:6 --level 10:8:6 --level 13:16:6 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s --cores 4 --coherence moesi -s 6 -E 8 -b 6 -t threads.trace\n", argv[0]);
+    printf("  linux>  %s --output yi.json -s 4 -E 1 -b 4 -t traces/yi.trace\n", argv[0]);
+    printf("  linux>  %s --convert traces/yi.trace yi.ctr\n", argv[0]);
+    printf("  linux>  %s --bench rows,cols -p lru\n", argv[0]);
+    printf("  linux>  %s -s 6 -E 8 -b 6 --perf-mem -- ./cache2Dcols\n", argv[0]);
+    printf("  linux>  valgrind --log-fd=1 --tool=lackey --trace-mem=yes ls | %s -s 8 -E 2 -b 4 -t -\n", argv[0]);
+    exit(0);
+}
+
+/*
+ * printSummary - Summarize the cache simulation statistics. Student cache simulators
+ *                must call this function in order to be properly autograded.
+ */
+CSIM_INTERNAL void printSummary(unsigned long long hits, unsigned long long misses,
+                                unsigned long long evictions)
+{
+    printf("hits:%llu misses:%llu evictions:%llu\n", hits, misses, evictions);
+    if (!write_results)
+        return;
+    FILE* output_fp = fopen(".csim_results", "w");
+    assert(output_fp);
+    fprintf(output_fp, "%llu %llu %llu\n", hits, misses, evictions);
+    fclose(output_fp);
+}
+
+/*
+ * printRanges - Print the top ranges by misses with the accesses they
+ *               got and the evictions of their blocks, and the top pairs
+ *               of ranges by how often the first evicted the second
+ */
+CSIM_INTERNAL void printRanges(const range_map_t* map, int top)
+{
+    size_t n = map->nranges + 1 > map->nconflicts ? map->nranges + 1 : map->nconflicts;
+    char* picked = calloc(n, 1);
+    if(!picked) {
+        fprintf(stderr, "printRanges: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    //a selection pass per row, as for the sets and regions
+    for(int k = 0; k < top && (size_t)k <= map->nranges; k++) {
+        size_t best = map->nranges + 1;
+        for(size_t i = 0; i <= map->nranges; i++)
+            if(!picked[i] && (best > map->nranges ||
+                              map->ranges[i].misses > map->ranges[best].misses))
+                best = i;
+        const range_t* r = &map->ranges[best];
+        if(r->hits + r->misses + r->evicted == 0)
+            break;
+        picked[best] = 1;
+        printf("range:%s hits:%llu misses:%llu evicted:%llu\n",
+               r->name, r->hits, r->misses, r->evicted);
+    }
+
+    memset(picked, 0, n);
+    for(int k = 0; k < top && (size_t)k < map->nconflicts; k++) {
+        size_t best = map->nconflicts;
+        for(size_t i = 0; i < map->nconflicts; i++)
+            if(!picked[i] && (best == map->nconflicts ||
+                              map->conflicts[i].count > map->conflicts[best].count))
+                best = i;
+        picked[best] = 1;
+        printf("conflict:%s evicts:%s count:%llu\n",
+               map->ranges[map->conflicts[best].evictor].name,
+               map->ranges[map->conflicts[best].victim].name, map->conflicts[best].count);
+    }
+    free(picked);
+}
+
+/*
+ * printDetail - Print the breakdown of a cache: the 3C classes of its
+ *               misses, the top sets and regions by misses and, with
+ *               --ranges, the top ranges and conflicting pairs
+ */
+CSIM_INTERNAL void printDetail(cache_t* cache, int top)
+{
+    detail_t* d = cache->detail;
+    char* picked = calloc(cache->S > d->nregions ? cache->S : d->nregions, 1);
+    if(!picked) {
+        fprintf(stderr, "printDetail: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    printf("cold-misses:%llu capacity-misses:%llu conflict-misses:%llu\n",
+           d->cold_misses, d->capacity_misses, d->conflict_misses);
+
+    //a selection pass per row; top is small next to the sets and regions
+    for(int k = 0; k < top && (size_t)k < cache->S; k++) {
+        size_t best = cache->S;
+        for(size_t i = 0; i < cache->S; i++)
+            if(!picked[i] && (best == cache->S || d->set_misses[i] > d->set_misses[best]))
+                best = i;
+        if(d->set_hits[best] + d->set_misses[best] == 0)
+            break;
+        picked[best] = 1;
+        printf("set:%zu hits:%llu misses:%llu\n",
+               best, d->set_hits[best], d->set_misses[best]);
+    }
+
+    memset(picked, 0, cache->S > d->nregions ? cache->S : d->nregions);
+    for(int k = 0; k < top && (size_t)k < d->nregions; k++) {
+        size_t best = d->nregions;
+        for(size_t i = 0; i < d->nregions; i++)
+            if(!picked[i] && (best == d->nregions ||
+                              d->regions[i].misses > d->regions[best].misses))
+                best = i;
+        picked[best] = 1;
+        printf("region:0x%llx-0x%llx hits:%llu misses:%llu\n",
+               d->regions[best].region << d->region_bits,
+               ((d->regions[best].region + 1) << d->region_bits) - 1,
+               d->regions[best].hits, d->regions[best].misses);
+    }
+    free(picked);
+    if(d->ranges)
+        printRanges(d->ranges, top);
+}
+
+/*
+ * printSampling - Print what share of the accesses a sampled cache
+ *                 measured and the 95% confidence intervals of its totals
+ */
+CSIM_INTERNAL void printSampling(cache_t* cache)
+{
+    sampling_t* smp = cache->sampling;
+    printf("sampled:%.4f hits-ci95:%.0f misses-ci95:%.0f\n",
+           smp->seen ? (double)smp->measured_accesses / smp->seen : 0.0,
+           smp->hits_ci, smp->misses_ci);
+}
+
+/*
+ * printCost - Print the cost of a run by the latency table, on the
+ *             current line
+ */
+CSIM_INTERNAL void printCost(cost_t c)
+{
+    printf("amat:%.3f cycles:%.0f stall-cycles:%.0f", c.amat, c.cycles, c.stall_cycles);
+}
+
+/*
+ * printTlb - Print the hits and misses of every TLB level of a cache and
+ *            its page walks, on the current line
+ */
+CSIM_INTERNAL void printTlb(const tlb_t* t)
+{
+    static const char* names[MAX_TLB_LEVELS] = { "dtlb", "stlb" };
+    for(int i = 0; i < t->nlevels; i++)
+        printf("%s%s-hits:%llu %s-misses:%llu", i ? " " : "", names[i],
+               t->levels[i].hit_count, names[i], t->levels[i].miss_count);
+    printf(" page-walks:%llu walk-refs:%llu", t->walks, t->walk_refs);
+}
+
+/*
+ * printSweep - Print the statistics of every cache of a sweep, one
+ *              configuration per line
+ */
+CSIM_INTERNAL void printSweep(cache_t* caches, int ncaches)
+{
+    for(int i = 0; i < ncaches; i++) {
+        printf("s:%d E:%d b:%d hits:%llu misses:%llu evictions:%llu",
+               caches[i].s, caches[i].E, caches[i].b,
+               caches[i].hit_count, caches[i].miss_count, caches[i].eviction_count);
+        if(write_stats)
+            printf(" dirty-evictions:%llu write-bytes:%llu",
+                   caches[i].dirty_eviction_count, caches[i].write_bytes);
+        if(split_lines)
+            printf(" line-crossings:%llu", caches[i].line_crossing_count);
+        if(caches[i].prefetcher)
+            printf(" prefetches:%llu useful:%llu late:%llu polluting:%llu",
+                   caches[i].prefetcher->issued, caches[i].useful_prefetch_count,
+                   caches[i].prefetcher->late, caches[i].polluting_prefetch_count);
+        if(caches[i].sampling)
+            printf(" hits-ci95:%.0f misses-ci95:%.0f",
+                   caches[i].sampling->hits_ci, caches[i].sampling->misses_ci);
+        if(caches[i].tlb) {
+            printf(" ");
+            printTlb(caches[i].tlb);
+        }
+        if(latency.enabled) {
+            printf(" ");
+            printCost(cacheCost(&caches[i]));
+        }
+        printf("\n");
+        if(caches[i].detail)
+            printDetail(&caches[i], detail_top);
+    }
+}
+
+/*
+ * printPrefetches - Print how well the prefetcher of a single cache did.
+ *   accuracy: share of issued prefetches a demand access used
+ *   coverage: share of would-be misses the prefetches turned into hits
+ */
+CSIM_INTERNAL void printPrefetches(cache_t* cache)
+{
+    prefetcher_t* pf = cache->prefetcher;
+    unsigned long long useful = cache->useful_prefetch_count;
+
+    printf("prefetches:%llu useful:%llu late:%llu polluting:%llu redundant:%llu accuracy:%.3f coverage:%.3f\n",
+           pf->issued, useful, pf->late, cache->polluting_prefetch_count, pf->redundant,
+           pf->issued ? (double)useful / pf->issued : 0.0,
+           useful + cache->miss_count ? (double)useful / (useful + cache->miss_count) : 0.0);
+}
+
+/*
+ * printWrites - Print the write traffic of a single cache
+ */
+CSIM_INTERNAL void printWrites(cache_t* cache)
+{
+    printf("dirty-evictions:%llu write-bytes:%llu\n",
+           cache->dirty_eviction_count, cache->write_bytes);
+}
+
+/*
+ * printHierarchy - Print the statistics of every level of a hierarchy
+ */
+CSIM_INTERNAL void printHierarchy(level_t* levels, int nlevels)
+{
+    for(int i = 0; i < nlevels; i++) {
+        printf("L%d hits:%llu misses:%llu evictions:%llu back-invalidations:%llu", i + 1,
+               levels[i].cache.hit_count, levels[i].cache.miss_count,
+               levels[i].cache.eviction_count, levels[i].back_invalidations);
+        if(write_stats)
+            printf(" dirty-evictions:%llu memory-write-bytes:%llu",
+                   levels[i].cache.dirty_eviction_count, levels[i].memory_write_bytes);
+        printf("\n");
+    }
+    if(split_lines)
+        printf("line-crossings:%llu\n", levels[0].cache.line_crossing_count);
+    if(latency.enabled) {
+        printCost(hierarchyCost(levels, nlevels));
+        printf("\n");
     }
- 
 }
 
-/* 
- * freeCache - free each piece of memory you allocated using malloc 
- * inside initCache() function
+/*
+ * printCoherence - Print the counters of every core, the totals, and the
+ *                  top blocks by false sharing misses
  */
-void freeCache()
+CSIM_INTERNAL void printCoherence(core_t* cores, int ncores, block_map_t* shared, int top)
 {
-S = pow(2,s);
-cache_set_t temp;
-for(int i = 0; i < S; i++) {
-	cache_set_t start = cache[i];
-   while(start->next != NULL) {
-	temp = start->next;
-	start->next = (start->next)->next;
-	free(temp);
-   }
-   free(cache[i]);
-}
-free(cache);
+    unsigned long long invalidations = 0, coherence = 0, false_sharing = 0, transfers = 0;
+    for(int i = 0; i < ncores; i++) {
+        const core_t* c = &cores[i];
+        printf("core:%d hits:%llu misses:%llu evictions:%llu coherence-misses:%llu "
+               "false-sharing-misses:%llu invalidations:%llu upgrades:%llu transfers:%llu "
+               "writebacks:%llu\n", i, c->cache.hit_count, c->cache.miss_count,
+               c->cache.eviction_count, c->coherence_misses, c->false_sharing_misses,
+               c->invalidations, c->upgrades, c->transfers, c->writebacks);
+        invalidations += c->invalidations;
+        coherence += c->coherence_misses;
+        false_sharing += c->false_sharing_misses;
+        transfers += c->transfers;
+    }
+
+    size_t lines = 0;
+    for(size_t i = 0; i < shared->nslots; i++)
+        lines += shared->slots[i].false_sharing > 0;
+    printf("invalidations:%llu coherence-misses:%llu false-sharing-misses:%llu "
+           "false-sharing-lines:%zu transfers:%llu\n",
+           invalidations, coherence, false_sharing, lines, transfers);
+
+    //a selection pass per row, as for --detail
+    char* picked = calloc(shared->nslots, 1);
+    if(!picked) {
+        fprintf(stderr, "printCoherence: %s\n", strerror(errno));
+        exit(1);
+    }
+    for(int k = 0; k < top && (size_t)k < lines; k++) {
+        size_t best = shared->nslots;
+        for(size_t i = 0; i < shared->nslots; i++)
+            if(!picked[i] && shared->slots[i].false_sharing &&
+               (best == shared->nslots ||
+                shared->slots[i].false_sharing > shared->slots[best].false_sharing))
+                best = i;
+        picked[best] = 1;
+        printf("false-sharing-line:0x%llx misses:%llu\n",
+               (shared->slots[best].key - 1) << cores[0].cache.b,
+               shared->slots[best].false_sharing);
+    }
+    free(picked);
 }
 
-/* 
- * accessData - Access data at memory address addr.
- *   If it is already in cache, increase hit_count
- *   If it is not in cache, bring it in cache, increase miss count.
- *   Also increase eviction_count if a line is evicted.
- *   you will manipulate data structures allocated in initCache() here
+/* Type: Report format
+ * Machine readable formats of --output
  */
-void accessData(mem_addr_t addr)
-{  
-  //extract s bits
-  //first, create mask with 0 for b and t bits and 1 for s bits
-  mem_addr_t mask = ((1 << s) - 1) << b;
-  
-  //AND the mask with the address to get just the s bits
-  mem_addr_t m = mask & addr;
-  
-  //shift s_bits over by b
-  int s_bits = m >> b;
-  
-//get t bits from original address
-  mem_addr_t t_bits = addr >> (s+b); 
-
-  cache_set_t line = cache[s_bits];
-  
-  //to check for matches
-  int match = 0;
-  
-  if(t_bits == line->tag) {
-	if(line->valid == 1) {
-	match = 1;
-	hit_count++;
-	}
-  }
-  int e = E;
-
-  while(!match && e > 1) {
-
-    if(t_bits ==( line->next)->tag) {
-        	if((line->next)->valid == 1) {
-          	//we have a match!
-            match = 1;
-        	//increase hit count
-        	  hit_count++;
-         
-        	//move cache line to the front of the list
-                //1. first line in set
-                cache_set_t next_first = line->next;
-                
-                //2. get the one that is currently after the one that will be first
-                cache_set_t after_next_first = (line->next)->next;
-        	
-                //3. make the one before the next_first point to the one after next_first
-                line->next = after_next_first;
-                
-                //4. save the address of the current first in the list
-                cache_set_t curr_first = cache[s_bits];
-        
-                //5. make the first line in the cache next_first
-                cache[s_bits] = next_first;
-        	
-                //6. make next_first point to curr_first
-                next_first->next = curr_first;
-             	
-        	break; 
-        	}
-   }
-   //update to next line
-   if(line->next != NULL){
-  
-     line = line->next;
-    }	
-   e--;
-  }
-   
-   //we didn't find a match
-  if(match == 0) {
-        cache_set_t check = cache[s_bits];
-      	miss_count++;
-      	e = 1;
-
-      	if(check->valid == 0)
-      		e = 0;
-
-      	//check for any open lines in set (valid = 0)
-      	while(e && check->next != NULL && (check->next)->valid == 1 &&  (check->next)->next != NULL) {
-      	   check = check->next;
-      	}
-      	if(!e) {
-      	    check->tag = t_bits;
-      	    check->valid = 1;    
-      	}
-      	else if(check->next != NULL && (check->next)->valid == 0) {
-   	   
-      	    cache_set_t after_next = (check->next)->next;
-      	    cache_set_t curr_first = cache[s_bits];
-      	     cache[s_bits] = check->next;  
-      	    (check->next)->next = curr_first;
-      	    (check->next)->tag = t_bits;
-      	    (check->next)->valid = 1;    
-          	 check->next = after_next;
-      	}
-      	 else if(check->next == NULL) {//no open lines, must evict
-      	
-      	     (*check).tag = t_bits;
-      	     (*check).valid = 1;   
-           	
-      	     eviction_count++;
-      	 }
-         
-      	else {
-      		eviction_count++;
-      		(check->next)->tag = t_bits;
-      		(check->next)->valid = 1;
-         
-	        //save the current first
-        	cache_set_t curr_first = cache[s_bits];
-      		(check->next)->next = curr_first;
-      		cache[s_bits] = check->next;
-           check->next = NULL;
-      	 	
-      	}
-}
+typedef enum output_format {
+    FORMAT_JSON,
+    FORMAT_CSV,
+    NUM_FORMATS
+} output_format_t;
+
+CSIM_INTERNAL const char* format_names[NUM_FORMATS] = { "json", "csv" };
+
+/* Type: Run
+ * What a report records about the run besides the simulated caches
+ */
+typedef struct run_info {
+    const char* trace;
+    const char* mode;   /* single, sweep, hierarchy or stack-distance */
+    double seconds;     /* wall time of the replay */
+} run_info_t;
+
+/*
+ * jsonString - write str as a JSON string literal
+ */
+static void jsonString(FILE* fp, const char* str)
+{
+    fputc('"', fp);
+    for(const unsigned char* p = (const unsigned char*)str; *p; p++) {
+        if(*p == '"' || *p == '\\')
+            fprintf(fp, "\\%c", *p);
+        else if(*p < 0x20)
+            fprintf(fp, "\\u%04x", *p);
+        else
+            fputc(*p, fp);
+    }
+    fputc('"', fp);
 }
 
-/* 
- * replayTrace - replays the given trace file against the cache 
- * reads the input trace file line by line
- * extracts the type of each memory access : L/S/M
- * one "L" as a load i.e. 1 memory access
- * one "S" as a store i.e. 1 memory access
- * one "M" as a load followed by a store i.e. 2 memory accesses 
+/*
+ * jsonCache - write the configuration and counters of a cache, and its
+ * prefetcher and breakdown if any, as the members of a JSON object
  */
-void replayTrace(char* trace_fn)
+static void jsonCache(FILE* fp, const cache_t* c)
 {
-    char buf[1000];
-    mem_addr_t addr=0;
-    unsigned int len=0;
-    FILE* trace_fp = fopen(trace_fn, "r");
+    fprintf(fp, "\"s\": %d, \"E\": %d, \"b\": %d, \"policy\": \"%s\", "
+            "\"write_through\": %s, \"write_allocate\": %s, \"split_lines\": %s, "
+            "\"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, "
+            "\"dirty_evictions\": %llu, \"write_bytes\": %llu, \"line_crossings\": %llu",
+            c->s, c->E, c->b, policy_names[c->policy],
+            c->write_mode & WRITE_THROUGH ? "true" : "false",
+            c->write_mode & WRITE_NO_ALLOCATE ? "false" : "true",
+            c->split_lines ? "true" : "false",
+            c->hit_count, c->miss_count, c->eviction_count,
+            c->dirty_eviction_count, c->write_bytes, c->line_crossing_count);
 
-    if(!trace_fp){
-        fprintf(stderr, "%s: %s\n", trace_fn, strerror(errno));
-        exit(1);
+    const prefetcher_t* pf = c->prefetcher;
+    if(pf)
+        fprintf(fp, ", \"prefetch\": {\"engine\": \"%s\", \"degree\": %d, \"latency\": %d, "
+                "\"issued\": %llu, \"useful\": %llu, \"late\": %llu, \"polluting\": %llu, "
+                "\"redundant\": %llu}",
+                prefetch_names[pf->kind], pf->degree, pf->latency, pf->issued,
+                c->useful_prefetch_count, pf->late, c->polluting_prefetch_count, pf->redundant);
+
+    if(latency.enabled && latency.nhits == 1) {
+        cost_t cost = cacheCost(c);
+        fprintf(fp, ", \"amat\": %.3f, \"cycles\": %.0f, \"stall_cycles\": %.0f",
+                cost.amat, cost.cycles, cost.stall_cycles);
     }
 
-    while( fgets(buf, 1000, trace_fp) != NULL) {
-        if(buf[1]=='S' || buf[1]=='L' || buf[1]=='M') {
-            sscanf(buf+3, "%llx,%u", &addr, &len);
-      
-            if(verbosity)
-                printf("%c %llx,%u ", buf[1], addr, len);
+    const tlb_t* t = c->tlb;
+    if(t) {
+        fprintf(fp, ", \"tlb\": {\"page_bits\": %d, \"levels\": [", t->page_bits);
+        for(int i = 0; i < t->nlevels; i++)
+            fprintf(fp, "%s{\"entries\": %zu, \"ways\": %d, \"hits\": %llu, \"misses\": %llu}",
+                    i ? ", " : "", t->levels[i].S * t->levels[i].E, t->levels[i].E,
+                    t->levels[i].hit_count, t->levels[i].miss_count);
+        fprintf(fp, "], \"walks\": %llu, \"walk_refs\": %llu}", t->walks, t->walk_refs);
+    }
 
-          
-           // now you have: 
-           // 1. address accessed in variable - addr 
-           // 2. type of acccess(S/L/M)  in variable - buf[1] 
-           // call accessData function here depending on type of access
+    const sampling_t* smp = c->sampling;
+    if(smp)
+        fprintf(fp, ", \"sampling\": {\"set_ratio\": %d, \"window\": %llu, \"period\": %llu, "
+                "\"warmup\": %llu, \"measured_accesses\": %llu, \"hits_ci95\": %.1f, "
+                "\"misses_ci95\": %.1f}",
+                smp->set_ratio, smp->window, smp->period, smp->warmup,
+                smp->measured_accesses, smp->hits_ci, smp->misses_ci);
 
-            if (verbosity)
-                printf("\n");
-	    //call accessData for the first time
-	    accessData(addr);
-	    //if we are doing a data modify, call accessData again
-	    if(buf[1] == 'M') {
-		accessData(addr);
-	    }
+    const detail_t* d = c->detail;
+    if(d) {
+        fprintf(fp, ", \"detail\": {\"cold_misses\": %llu, \"capacity_misses\": %llu, "
+                "\"conflict_misses\": %llu, \"sets\": [",
+                d->cold_misses, d->capacity_misses, d->conflict_misses);
+        for(size_t i = 0; i < c->S; i++)
+            fprintf(fp, "%s{\"set\": %zu, \"hits\": %llu, \"misses\": %llu}",
+                    i ? ", " : "", i, d->set_hits[i], d->set_misses[i]);
+        fprintf(fp, "], \"region_bits\": %d, \"regions\": [", d->region_bits);
+        for(size_t i = 0; i < d->nregions; i++)
+            fprintf(fp, "%s{\"start\": %llu, \"hits\": %llu, \"misses\": %llu}",
+                    i ? ", " : "", d->regions[i].region << d->region_bits,
+                    d->regions[i].hits, d->regions[i].misses);
+        fprintf(fp, "]");
+        const range_map_t* m = d->ranges;
+        if(m) {
+            fprintf(fp, ", \"ranges\": [");
+            for(size_t i = 0; i <= m->nranges; i++) {
+                fprintf(fp, "%s{\"name\": ", i ? ", " : "");
+                jsonString(fp, m->ranges[i].name);
+                fprintf(fp, ", \"start\": %llu, \"end\": %llu, \"hits\": %llu, "
+                        "\"misses\": %llu, \"evicted\": %llu}",
+                        m->ranges[i].start, m->ranges[i].end, m->ranges[i].hits,
+                        m->ranges[i].misses, m->ranges[i].evicted);
+            }
+            fprintf(fp, "], \"conflicts\": [");
+            for(size_t i = 0; i < m->nconflicts; i++)
+                fprintf(fp, "%s{\"evictor\": %u, \"victim\": %u, \"count\": %llu}",
+                        i ? ", " : "", m->conflicts[i].evictor, m->conflicts[i].victim,
+                        m->conflicts[i].count);
+            fprintf(fp, "]");
         }
+        fprintf(fp, "}");
     }
-
-    fclose(trace_fp);
 }
 
+/* Columns csvCache() writes */
+#define CSV_CACHE_HEADER "s,E,b,policy,write_through,write_allocate,split_lines," \
+    "hits,misses,evictions,dirty_evictions,write_bytes,line_crossings," \
+    "prefetch,prefetch_degree,prefetch_latency,prefetches,useful_prefetches," \
+    "late_prefetches,polluting_prefetches,redundant_prefetches," \
+    "cold_misses,capacity_misses,conflict_misses,dtlb_misses,stlb_misses,page_walks," \
+    "amat,stall_cycles"
+
 /*
- * printUsage - Print usage info
+ * csvCache - write the configuration and counters of a cache as the
+ * CSV_CACHE_HEADER fields of a row, leaving the prefetch and breakdown
+ * fields empty without them
  */
-void printUsage(char* argv[])
+static void csvCache(FILE* fp, const cache_t* c)
 {
-    printf("Usage: %s [-hv] -s <num> -E <num> -b <num> -t <file>\n", argv[0]);
-    printf("Options:\n");
-    printf("  -h         Print this help message.\n");
-    printf("  -v         Optional verbose flag.\n");
-    printf("  -s <num>   Number of set index bits.\n");
-    printf("  -E <num>   Number of lines per set.\n");
-    printf("  -b <num>   Number of block offset bits.\n");
-    printf("  -t <file>  Trace file.\n");
-    printf("\nExamples:\n");
-    printf("  linux>  %s -s 4 -E 1 -b 4 -t traces/yi.trace\n", argv[0]);
-    printf("  linux>  %s -v -s 8 -E 2 -b 4 -t traces/yi.trace\n", argv[0]);
-    exit(0);
+    fprintf(fp, "%d,%d,%d,%s,%d,%d,%d,%llu,%llu,%llu,%llu,%llu,%llu,",
+            c->s, c->E, c->b, policy_names[c->policy],
+            !!(c->write_mode & WRITE_THROUGH), !(c->write_mode & WRITE_NO_ALLOCATE),
+            c->split_lines, c->hit_count, c->miss_count, c->eviction_count,
+            c->dirty_eviction_count, c->write_bytes, c->line_crossing_count);
+
+    const prefetcher_t* pf = c->prefetcher;
+    if(pf)
+        fprintf(fp, "%s,%d,%d,%llu,%llu,%llu,%llu,%llu,",
+                prefetch_names[pf->kind], pf->degree, pf->latency, pf->issued,
+                c->useful_prefetch_count, pf->late, c->polluting_prefetch_count, pf->redundant);
+    else
+        fprintf(fp, "none,,,,,,,,");
+
+    const detail_t* d = c->detail;
+    if(d)
+        fprintf(fp, "%llu,%llu,%llu,", d->cold_misses, d->capacity_misses, d->conflict_misses);
+    else
+        fprintf(fp, ",,,");
+
+    const tlb_t* t = c->tlb;
+    if(t && t->nlevels > 1)
+        fprintf(fp, "%llu,%llu,%llu", t->levels[0].miss_count, t->levels[1].miss_count, t->walks);
+    else if(t)
+        fprintf(fp, "%llu,,%llu", t->levels[0].miss_count, t->walks);
+    else
+        fprintf(fp, ",,");
+
+    if(latency.enabled && latency.nhits == 1) {
+        cost_t cost = cacheCost(c);
+        fprintf(fp, ",%.3f,%.0f", cost.amat, cost.stall_cycles);
+    } else {
+        fprintf(fp, ",,");
+    }
 }
 
 /*
- * printSummary - Summarize the cache simulation statistics. Student cache simulators
- *                must call this function in order to be properly autograded.
+ * writeReport - write the results of a run to fn ("-" is standard output,
+ * or report_fp if main moved it aside) in format. Pass the caches of a
+ * single cache or sweep, the levels of a hierarchy or the engines of a
+ * stack distance run, NULL for the others.
+ * A CSV report has one row per cache, level or stack distance point; the
+ * per-set and per-region tables of --detail are only in JSON.
  */
-void printSummary(int hits, int misses, int evictions)
+CSIM_INTERNAL void writeReport(const char* fn, output_format_t format, const run_info_t* run,
+                               const cache_t* caches, int ncaches, const level_t* levels,
+                               int nlevels, const sd_engine_t* engines, int nengines)
 {
-    printf("hits:%d misses:%d evictions:%d\n", hits, misses, evictions);
-    FILE* output_fp = fopen(".csim_results", "w");
-    assert(output_fp);
-    fprintf(output_fp, "%d %d %d\n", hits, misses, evictions);
-    fclose(output_fp);
+    bool to_stdout = strcmp(fn, "-") == 0;
+    FILE* fp = to_stdout ? (report_fp ? report_fp : stdout) : fopen(fn, "w");
+    if(!fp) {
+        fprintf(stderr, "%s: %s\n", fn, strerror(errno));
+        exit(1);
+    }
+
+    if(format == FORMAT_JSON) {
+        fprintf(fp, "{\n  \"trace\": ");
+        jsonString(fp, run->trace);
+        fprintf(fp, ",\n  \"mode\": \"%s\",\n  \"seconds\": %.6f", run->mode, run->seconds);
+        if(profile.enabled) {
+            fprintf(fp, ",\n  \"profile\": {\"accesses\": %llu", profile.accesses);
+            for(phase_t p = 0; p < NUM_PHASES; p++) {
+                fprintf(fp, ", \"%s\": {\"seconds\": %.6f", phase_names[p], profile.seconds[p]);
+                for(int i = 0; i < NUM_PERF_COUNTERS; i++)
+                    if(profile.fds[i] >= 0)
+                        fprintf(fp, ", \"%s\": %llu", perf_counter_names[i], profile.counts[p][i]);
+                fprintf(fp, "}");
+            }
+            fprintf(fp, "}");
+        }
+        if(caches) {
+            fprintf(fp, ",\n  \"caches\": [");
+            for(int i = 0; i < ncaches; i++) {
+                fprintf(fp, "%s\n    {", i ? "," : "");
+                jsonCache(fp, &caches[i]);
+                fprintf(fp, "}");
+            }
+            fprintf(fp, "\n  ]");
+        }
+        if(levels) {
+            fprintf(fp, ",\n  \"levels\": [");
+            for(int i = 0; i < nlevels; i++) {
+                fprintf(fp, "%s\n    {\"level\": %d, \"inclusion\": \"%s\", "
+                        "\"back_invalidations\": %llu, \"memory_write_bytes\": %llu, ",
+                        i ? "," : "", i + 1, inclusion_names[levels[i].inclusion],
+                        levels[i].back_invalidations, levels[i].memory_write_bytes);
+                jsonCache(fp, &levels[i].cache);
+                fprintf(fp, "}");
+            }
+            fprintf(fp, "\n  ]");
+            if(latency.enabled) {
+                cost_t cost = hierarchyCost(levels, nlevels);
+                fprintf(fp, ",\n  \"amat\": %.3f, \"cycles\": %.0f, \"stall_cycles\": %.0f",
+                        cost.amat, cost.cycles, cost.stall_cycles);
+            }
+        }
+        if(engines) {
+            fprintf(fp, ",\n  \"curves\": [");
+            for(int i = 0, first = 1; i < nengines; i++)
+                for(int E = 1; E <= engines[i].maxE; E++, first = 0) {
+                    unsigned long long misses, evictions;
+                    sdCurve(&engines[i], E, &misses, &evictions);
+                    fprintf(fp, "%s\n    {\"s\": %d, \"E\": %d, \"b\": %d, \"hits\": %llu, "
+                            "\"misses\": %llu, \"evictions\": %llu}",
+                            first ? "" : ",", engines[i].s, E, engines[i].b,
+                            engines[i].accesses - misses, misses, evictions);
+                }
+            fprintf(fp, "\n  ]");
+        }
+        fprintf(fp, "\n}\n");
+    } else {
+        if(caches) {
+            fprintf(fp, CSV_CACHE_HEADER ",seconds\n");
+            for(int i = 0; i < ncaches; i++) {
+                csvCache(fp, &caches[i]);
+                fprintf(fp, ",%.6f\n", run->seconds);
+            }
+        }
+        if(levels) {
+            fprintf(fp, "level,inclusion,back_invalidations,memory_write_bytes,"
+                    CSV_CACHE_HEADER ",seconds\n");
+            for(int i = 0; i < nlevels; i++) {
+                fprintf(fp, "%d,%s,%llu,%llu,", i + 1, inclusion_names[levels[i].inclusion],
+                        levels[i].back_invalidations, levels[i].memory_write_bytes);
+                csvCache(fp, &levels[i].cache);
+                fprintf(fp, ",%.6f\n", run->seconds);
+            }
+        }
+        if(engines) {
+            fprintf(fp, "s,E,b,hits,misses,evictions,seconds\n");
+            for(int i = 0; i < nengines; i++)
+                for(int E = 1; E <= engines[i].maxE; E++) {
+                    unsigned long long misses, evictions;
+                    sdCurve(&engines[i], E, &misses, &evictions);
+                    fprintf(fp, "%d,%d,%d,%llu,%llu,%llu,%.6f\n", engines[i].s, E, engines[i].b,
+                            engines[i].accesses - misses, misses, evictions, run->seconds);
+                }
+        }
+    }
+
+    if(to_stdout ? fflush(fp) != 0 : fclose(fp) != 0) {
+        fprintf(stderr, "%s: %s\n", fn, strerror(errno));
+        exit(1);
+    }
 }
 
+#ifndef CSIM_LIBRARY
 /*
  * main - Main routine 
  */
 int main(int argc, char* argv[])
 {
-    char c;
+    int c;
+    int s = 0; /* set index bits */
+    int b = 0; /* block offset bits */
+    int E = 0; /* associativity */
+    char* trace_file = NULL;
+    char* convert_file = NULL;
+    geometry_t* sweep = NULL; /* geometries requested with --sweep */
+    int nsweep = 0;
+    bool stack_distance = false;
+    policy_t policy = POLICY_LRU;
+    int write_mode = 0; /* write_mode_t flags */
+    prefetch_kind_t prefetch = PREFETCH_NONE;
+    int prefetch_degree = 1;
+    int prefetch_latency = 0;
+    bool detail = false;
+    char* output_file = NULL; /* --output report, if any */
+    output_format_t format = FORMAT_JSON;
+    double start;
+    char* bench = NULL; /* --bench workloads, if any */
+    int bench_accesses = BENCH_ACCESSES;
+    bool policy_set = false;
+    char* restore_file = NULL; /* --restore snapshot, if any */
+    int sample_sets = 0; /* --sample-sets ratio, 0 for none */
+    unsigned long long sample_window = 0, sample_period = 0, sample_warmup = 0;
+    int region_bits = DETAIL_REGION_BITS;
+    char* ranges_file = NULL; /* --ranges map, if any */
+    mem_addr_t ranges_offset = 0;
+    range_map_t ranges;
+    char** level_specs = NULL; /* --level arguments, parsed once -p is known */
+    int nlevels = 0;
+    bool perf_mem = false; /* run the program after the options instead of -t */
+    unsigned long long interval = 0; /* --interval window, 0 for none */
+    int ncores = 0; /* --cores private caches, 0 for a single cache */
+    int tlb_levels = 0; /* --tlb levels, 0 for none */
+    int tlb_entries[MAX_TLB_LEVELS], tlb_ways[MAX_TLB_LEVELS];
+    int page_bits = 12;
+    protocol_t protocol = PROTOCOL_MESI;
+    unsigned long long perf_period = LIVE_PERIOD;
+    static struct option long_options[] = {
+        {"convert", required_argument, NULL, 'C'},
+        {"sweep", required_argument, NULL, 'W'},
+        {"threads", required_argument, NULL, 'j'},
+        {"stack-distance", no_argument, NULL, 'D'},
+        {"level", required_argument, NULL, 'L'},
+        {"prefetch", required_argument, NULL, 'P'},
+        {"prefetch-latency", required_argument, NULL, 'Q'},
+        {"detail", no_argument, NULL, 'X'},
+        {"top", required_argument, NULL, 'T'},
+        {"region-bits", required_argument, NULL, 'R'},
+        {"ranges", required_argument, NULL, 'U'},
+        {"output", required_argument, NULL, 'O'},
+        {"format", required_argument, NULL, 'F'},
+        {"results", no_argument, NULL, 'G'},
+        {"bench", required_argument, NULL, 'B'},
+        {"bench-accesses", required_argument, NULL, 'N'},
+        {"profile", no_argument, NULL, 'Y'},
+        {"readahead", required_argument, NULL, 'A'},
+        {"sample-sets", required_argument, NULL, 'S'},
+        {"checkpoint-every", required_argument, NULL, 'K'},
+        {"checkpoint-file", required_argument, NULL, 'k'},
+        {"restore", required_argument, NULL, 'r'},
+        {"sample-time", required_argument, NULL, 'M'},
+        {"perf-mem", no_argument, NULL, 'I'},
+        {"interval", required_argument, NULL, 'V'},
+        {"cores", required_argument, NULL, 'c'},
+        {"tlb", required_argument, NULL, 'e'},
+        {"latency", required_argument, NULL, 'a'},
+        {"prefetch-overlap", required_argument, NULL, 'o'},
+        {"page-size", required_argument, NULL, 'g'},
+        {"coherence", required_argument, NULL, 'H'},
+        {"perf-period", required_argument, NULL, 'J'},
+        {NULL, 0, NULL, 0}
+    };
     
-    // Parse the command line arguments: -h, -v, -s, -E, -b, -t 
-    while( (c=getopt(argc,argv,"s:E:b:t:vh")) != -1){
+    // Parse the command line arguments: -h, -v, -l, -s, -E, -b, -t, -j, -p, -w, --sweep, --convert
+    while( (c=getopt_long(argc,argv,"s:E:b:t:j:p:w:vlh",long_options,NULL)) != -1){
         switch(c){
+        case 'C':
+            convert_file = optarg;
+            break;
+        case 'W':
+            addSweep(&sweep, &nsweep, optarg);
+            break;
+        case 'D':
+            stack_distance = true;
+            break;
+        case 'w':
+            write_stats = 1;
+            for (char* mode = strtok(optarg, ","); mode; mode = strtok(NULL, ",")) {
+                if (strcmp(mode, "wb") == 0)
+                    write_mode &= ~WRITE_THROUGH;
+                else if (strcmp(mode, "wt") == 0)
+                    write_mode |= WRITE_THROUGH;
+                else if (strcmp(mode, "wa") == 0)
+                    write_mode &= ~WRITE_NO_ALLOCATE;
+                else if (strcmp(mode, "nwa") == 0)
+                    write_mode |= WRITE_NO_ALLOCATE;
+                else {
+                    printf("%s: Unknown write policy %s\n", argv[0], mode);
+                    printUsage(argv);
+                    exit(1);
+                }
+            }
+            break;
+        case 'P': {
+            size_t len = strcspn(optarg, ":");
+            for (prefetch = 0; prefetch < NUM_PREFETCH_KINDS; prefetch++)
+                if (strlen(prefetch_names[prefetch]) == len &&
+                    strncmp(optarg, prefetch_names[prefetch], len) == 0)
+                    break;
+            if (optarg[len] == ':')
+                prefetch_degree = atoi(optarg + len + 1);
+            if (prefetch == NUM_PREFETCH_KINDS || prefetch_degree < 1) {
+                printf("%s: Unknown prefetcher %s\n", argv[0], optarg);
+                printUsage(argv);
+                exit(1);
+            }
+            break;
+        }
+        case 'Q':
+            prefetch_latency = atoi(optarg);
+            if (prefetch_latency < 0) {
+                printf("%s: --prefetch-latency cannot be negative\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'X':
+            detail = true;
+            break;
+        case 'T':
+            detail_top = atoi(optarg);
+            if (detail_top < 1) {
+                printf("%s: --top needs a positive row count\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'R':
+            region_bits = atoi(optarg);
+            if (region_bits < 0 || region_bits > 63) {
+                printf("%s: --region-bits must be between 0 and 63\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'U': {
+            //an offset after the last colon moves every range
+            char* colon = strrchr(optarg, ':');
+            if (colon) {
+                char* end;
+                ranges_offset = strtoull(colon + 1, &end, 16);
+                if (end == colon + 1 || *end) {
+                    printf("%s: --ranges needs <file>[:<offset>] with a hex offset\n", argv[0]);
+                    exit(1);
+                }
+                *colon = '\0';
+            }
+            ranges_file = optarg;
+            detail = true;
+            break;
+        }
+        case 'O':
+            output_file = optarg;
+            break;
+        case 'F':
+            for (format = 0; format < NUM_FORMATS; format++)
+                if (strcmp(optarg, format_names[format]) == 0)
+                    break;
+            if (format == NUM_FORMATS) {
+                printf("%s: Unknown output format %s\n", argv[0], optarg);
+                printUsage(argv);
+                exit(1);
+            }
+            break;
+        case 'G':
+            write_results = 1;
+            break;
+        case 'B':
+            bench = optarg;
+            break;
+        case 'Y':
+            initProfile();
+            break;
+        case 'K':
+            checkpoint_every = strtoull(optarg, NULL, 10);
+            if (checkpoint_every == 0) {
+                printf("%s: --checkpoint-every needs a positive access count\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'k':
+            checkpoint_file = optarg;
+            break;
+        case 'r':
+            restore_file = optarg;
+            break;
+        case 'S':
+            sample_sets = atoi(optarg);
+            if (sample_sets < 1) {
+                printf("%s: --sample-sets needs a positive ratio\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'M': {
+            int n = sscanf(optarg, "%llu:%llu:%llu", &sample_window, &sample_period, &sample_warmup);
+            if (n == 2)
+                sample_warmup = sample_window;
+            if (n < 2 || sample_window == 0 || sample_window + sample_warmup > sample_period) {
+                printf("%s: --sample-time needs <window>:<period>[:<warmup>] with "
+                       "window + warmup <= period\n", argv[0]);
+                exit(1);
+            }
+            break;
+        }
+        case 'I':
+            perf_mem = true;
+            break;
+        case 'a': {
+            //<hit>[,<hit>...]:<memory>[:<writeback>[:<walk>]]
+            char* rest = optarg + strcspn(optarg, ":");
+            int n = 0;
+            bool too_many = false;
+            latency.nhits = 0;
+            latency.enabled = true;
+            if (*rest)
+                *rest++ = '\0';
+            for (char* hit = strtok(optarg, ","); hit; hit = strtok(NULL, ",")) {
+                too_many |= latency.nhits == MAX_LATENCY_LEVELS;
+                if (!too_many)
+                    latency.hit[latency.nhits++] = atof(hit);
+            }
+            if (*rest)
+                n = sscanf(rest, "%lf:%lf:%lf", &latency.memory, &latency.writeback, &latency.walk);
+            if (latency.nhits == 0 || n < 1 || too_many) {
+                printf("%s: --latency needs <hit>[,<hit>...]:<memory>[:<writeback>[:<walk>]]\n",
+                       argv[0]);
+                exit(1);
+            }
+            break;
+        }
+        case 'o':
+            latency.overlap = atof(optarg);
+            if (latency.overlap < 0 || latency.overlap > 1) {
+                printf("%s: --prefetch-overlap must be between 0 and 1\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'e':
+            tlb_levels = 0;
+            for (char* spec = strtok(optarg, ","); spec; spec = strtok(NULL, ",")) {
+                int n = tlb_levels++;
+                if (n == MAX_TLB_LEVELS ||
+                    sscanf(spec, "%d:%d", &tlb_entries[n], &tlb_ways[n]) != 2 ||
+                    tlb_ways[n] < 1 || tlb_entries[n] < tlb_ways[n] ||
+                    tlb_entries[n] % tlb_ways[n] ||
+                    (tlb_entries[n] / tlb_ways[n] & (tlb_entries[n] / tlb_ways[n] - 1))) {
+                    printf("%s: --tlb needs <entries>:<ways>[,<entries>:<ways>] with a power\n"
+                           "of 2 sets at each level\n", argv[0]);
+                    exit(1);
+                }
+            }
+            break;
+        case 'g': {
+            char* end;
+            unsigned long long size = strtoull(optarg, &end, 10);
+            if (*end == 'k' || *end == 'K')
+                size <<= 10, end++;
+            else if (*end == 'm' || *end == 'M')
+                size <<= 20, end++;
+            else if (*end == 'g' || *end == 'G')
+                size <<= 30, end++;
+            if (*end || size < 2 || (size & (size - 1))) {
+                printf("%s: --page-size needs a power of 2 size over 1, such as 4k, 2m or 1g\n",
+                       argv[0]);
+                exit(1);
+            }
+            page_bits = __builtin_ctzll(size);
+            break;
+        }
+        case 'c':
+            ncores = atoi(optarg);
+            if (ncores < 1) {
+                printf("%s: --cores needs a positive core count\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'H':
+            for (protocol = 0; protocol < NUM_PROTOCOLS; protocol++)
+                if (strcmp(optarg, protocol_names[protocol]) == 0)
+                    break;
+            if (protocol == NUM_PROTOCOLS) {
+                printf("%s: Unknown coherence protocol %s\n", argv[0], optarg);
+                printUsage(argv);
+                exit(1);
+            }
+            break;
+        case 'V':
+            interval = strtoull(optarg, NULL, 10);
+            if (interval == 0) {
+                printf("%s: --interval needs a positive access count\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'J':
+            perf_period = strtoull(optarg, NULL, 10);
+            if (perf_period == 0) {
+                printf("%s: --perf-period needs a positive access count\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'A':
+            readahead = atoi(optarg);
+            if (readahead < 0) {
+                printf("%s: --readahead cannot be negative\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'N':
+            bench_accesses = atoi(optarg);
+            if (bench_accesses < 1) {
+                printf("%s: --bench-accesses needs a positive count\n", argv[0]);
+                exit(1);
+            }
+            break;
+        case 'L':
+            level_specs = realloc(level_specs, (nlevels + 1) * sizeof(char*));
+            level_specs[nlevels++] = optarg;
+            break;
+        case 'p':
+            for (policy = 0; policy < NUM_POLICIES; policy++)
+                if (strcmp(optarg, policy_names[policy]) == 0)
+                    break;
+            if (policy == NUM_POLICIES) {
+                printf("%s: Unknown replacement policy %s\n", argv[0], optarg);
+                printUsage(argv);
+                exit(1);
+            }
+            policy_set = true;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) {
+                printf("%s: -j needs a positive thread count\n", argv[0]);
+                exit(1);
+            }
+            break;
         case 's':
             s = atoi(optarg);
             break;
@@ -364,6 +6116,9 @@ int main(int argc, char* argv[])
         case 'v':
             verbosity = 1;
             break;
+        case 'l':
+            split_lines = 1;
+            break;
         case 'h':
             printUsage(argv);
             exit(0);
@@ -373,6 +6128,375 @@ int main(int argc, char* argv[])
         }
     }
 
+    //keep standard output for the report and print everything else to stderr
+    if (output_file && strcmp(output_file, "-") == 0) {
+        int fd = dup(STDOUT_FILENO);
+        if (fd < 0 || !(report_fp = fdopen(fd, "w")) || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            exit(1);
+        }
+    }
+
+    //the TLB levels replace pages by -p too
+    for (int i = 0; i < tlb_levels; i++)
+        if (policy == POLICY_PLRU && (tlb_ways[i] > 64 || (tlb_ways[i] & (tlb_ways[i] - 1)))) {
+            printf("%s: --tlb with -p plru needs a power of 2 ways up to 64, not %d\n",
+                   argv[0], tlb_ways[i]);
+            exit(1);
+        }
+
+    //a reader thread only overlaps the simulation given a second CPU
+    if (readahead < 0)
+        readahead = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? READAHEAD_BATCHES : 0;
+
+    /* Conversion needs no cache */
+    if (convert_file) {
+        if (optind >= argc) {
+            printf("%s: --convert needs an output file\n", argv[0]);
+            printUsage(argv);
+            exit(1);
+        }
+        convertTrace(convert_file, argv[optind]);
+        return 0;
+    }
+
+    /* A benchmark simulates generated workloads instead of a trace */
+    if (bench) {
+        bool workloads[NUM_WORKLOADS] = { false };
+        bool policies[NUM_POLICIES] = { false };
+        for (char* name = strtok(bench, ","); name; name = strtok(NULL, ",")) {
+            workload_t w;
+            for (w = 0; w < NUM_WORKLOADS; w++)
+                if (strcmp(name, "all") == 0 || strcmp(name, workload_names[w]) == 0)
+                    workloads[w] = true;
+            if (strcmp(name, "all") != 0) {
+                for (w = 0; w < NUM_WORKLOADS; w++)
+                    if (strcmp(name, workload_names[w]) == 0)
+                        break;
+                if (w == NUM_WORKLOADS) {
+                    printf("%s: Unknown workload %s\n", argv[0], name);
+                    printUsage(argv);
+                    exit(1);
+                }
+            }
+        }
+        //a typical L1 unless a geometry is given
+        if (s == 0 && E == 0 && b == 0) {
+            s = 6;
+            E = 8;
+            b = 6;
+        }
+        if (s == 0 || E == 0 || b == 0) {
+            printf("%s: --bench needs all of -s, -E and -b or none\n", argv[0]);
+            exit(1);
+        }
+        //every policy unless -p picks one; PLRU needs a power of 2 ways
+        for (policy_t p = 0; p < NUM_POLICIES; p++)
+            policies[p] = policy_set ? p == policy :
+                p != POLICY_PLRU || (E <= 64 && (E & (E - 1)) == 0);
+        runBench(workloads, policies, bench_accesses, (geometry_t){ s, E, b }, write_mode);
+        return 0;
+    }
+
+    if (ranges_file)
+        loadRanges(&ranges, ranges_file, ranges_offset);
+
+    /* The latency table has one hit latency per level simulated */
+    if (latency.enabled) {
+        if (stack_distance || ncores > 0 || sample_sets || sample_window) {
+            printf("%s: --latency cannot cost --stack-distance, --cores or sampling\n", argv[0]);
+            exit(1);
+        }
+        if (latency.nhits != (nlevels > 0 ? nlevels : 1)) {
+            printf("%s: --latency needs one hit latency per level, %d here\n", argv[0],
+                   nlevels > 0 ? nlevels : 1);
+            exit(1);
+        }
+    }
+
+    /* A live program stands in for the trace of a plain cache or sweep */
+    if (perf_mem) {
+        if (optind >= argc || trace_file) {
+            printf("%s: --perf-mem needs a program after the options instead of -t\n", argv[0]);
+            printUsage(argv);
+            exit(1);
+        }
+        if (nlevels > 0 || stack_distance || checkpoint_every || restore_file) {
+            printf("%s: --perf-mem cannot feed --level, --stack-distance or checkpoints\n", argv[0]);
+            exit(1);
+        }
+        trace_file = argv[optind];
+    }
+
+    /* Coherent private caches replace the single cache */
+    if (ncores > 0) {
+        if (s == 0 || E == 0 || b == 0 || trace_file == NULL) {
+            printf("%s: Missing required command line argument\n", argv[0]);
+            printUsage(argv);
+            exit(1);
+        }
+        if (nsweep > 0 || nlevels > 0 || stack_distance || prefetch != PREFETCH_NONE || detail ||
+            sample_sets || sample_window || interval || checkpoint_every || restore_file ||
+            perf_mem || write_mode != 0 || tlb_levels) {
+            printf("%s: --cores models write-back, write-allocate caches without sweeps,\n"
+                   "hierarchies, --detail, prefetching, sampling, --interval, checkpoints,\n"
+                   "--perf-mem or --tlb\n", argv[0]);
+            exit(1);
+        }
+        core_t* cores = malloc(ncores * sizeof(core_t));
+        if (!cores) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            exit(1);
+        }
+        block_map_t shared;
+        initCores(cores, ncores, s, E, b, policy, &shared);
+        for (int i = 0; i < ncores; i++)
+            cores[i].cache.split_lines = split_lines;
+
+        start = wallClock();
+        replayCoherent(trace_file, cores, ncores, protocol, &shared);
+        double seconds = wallClock() - start;
+
+        unsigned long long hits = 0, misses = 0, evictions = 0;
+        for (int i = 0; i < ncores; i++) {
+            hits += cores[i].cache.hit_count;
+            misses += cores[i].cache.miss_count;
+            evictions += cores[i].cache.eviction_count;
+        }
+        printCoherence(cores, ncores, &shared, detail_top);
+        printSummary(hits, misses, evictions);
+        if (profile.enabled)
+            printProfile();
+        if (output_file) {
+            cache_t* caches = malloc(ncores * sizeof(cache_t));
+            if (!caches) {
+                fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+                exit(1);
+            }
+            for (int i = 0; i < ncores; i++)
+                caches[i] = cores[i].cache;
+            run_info_t run = { trace_file, "coherence", seconds };
+            writeReport(output_file, format, &run, caches, ncores, NULL, 0, NULL, 0);
+            free(caches);
+        }
+        freeCores(cores, ncores, &shared);
+        free(cores);
+        return 0;
+    }
+
+    /* A checkpoint holds the caches alone, so nothing may sit beside them */
+    if ((checkpoint_every || restore_file) &&
+        (nlevels > 0 || stack_distance || prefetch != PREFETCH_NONE || detail ||
+         sample_sets || sample_window || interval || tlb_levels)) {
+        printf("%s: checkpoints cover plain caches and sweeps only\n", argv[0]);
+        exit(1);
+    }
+
+    /* A hierarchy replaces the single -s/-E/-b configuration */
+    if (nlevels > 0) {
+        if (trace_file == NULL) {
+            printf("%s: Missing required command line argument\n", argv[0]);
+            printUsage(argv);
+            exit(1);
+        }
+        if (nsweep > 0 || stack_distance) {
+            printf("%s: --level cannot be combined with --sweep or --stack-distance\n", argv[0]);
+            exit(1);
+        }
+        if (write_mode != 0) {
+            printf("%s: a hierarchy is always write-back, write-allocate\n", argv[0]);
+            exit(1);
+        }
+        if (prefetch != PREFETCH_NONE || detail || sample_sets || sample_window || interval ||
+            tlb_levels) {
+            printf("%s: --prefetch, --detail, sampling, --interval and --tlb do not model\n"
+                   "hierarchies\n", argv[0]);
+            exit(1);
+        }
+        level_t* levels = NULL;
+        int n = 0;
+        for (int i = 0; i < nlevels; i++)
+            addLevel(&levels, &n, level_specs[i], policy);
+        levels[0].cache.split_lines = split_lines;
+
+        start = wallClock();
+        replayHierarchy(trace_file, levels, nlevels);
+
+        printHierarchy(levels, nlevels);
+        if (profile.enabled)
+            printProfile();
+        if (output_file) {
+            run_info_t run = { trace_file, "hierarchy", wallClock() - start };
+            writeReport(output_file, format, &run, NULL, 0, levels, nlevels, NULL, 0);
+        }
+        for (int i = 0; i < nlevels; i++)
+            freeCache(&levels[i].cache);
+        free(levels);
+        free(level_specs);
+        return 0;
+    }
+
+    /* A stack distance pass covers every associativity of each s:b pair */
+    if (stack_distance) {
+        if (policy != POLICY_LRU || prefetch != PREFETCH_NONE || detail || sample_sets ||
+            sample_window || interval || tlb_levels) {
+            printf("%s: --stack-distance models LRU without prefetching, --detail, sampling,\n"
+                   "--interval or --tlb only\n", argv[0]);
+            exit(1);
+        }
+        if (nsweep == 0) {
+            if (s == 0 || E == 0 || b == 0) {
+                printf("%s: Missing required command line argument\n", argv[0]);
+                printUsage(argv);
+                exit(1);
+            }
+            sweep = malloc(sizeof(geometry_t));
+            sweep[nsweep++] = (geometry_t){ s, E, b };
+        }
+        if (trace_file == NULL) {
+            printf("%s: Missing required command line argument\n", argv[0]);
+            printUsage(argv);
+            exit(1);
+        }
+
+        //one engine per distinct s:b, covering up to its largest E
+        sd_engine_t* engines = malloc(nsweep * sizeof(sd_engine_t));
+        int nengines = 0;
+        for (int i = 0; i < nsweep; i++) {
+            int j = 0;
+            while (j < i && (sweep[j].s != sweep[i].s || sweep[j].b != sweep[i].b))
+                j++;
+            if (j < i)
+                continue;
+            int maxE = sweep[i].E;
+            for (j = i + 1; j < nsweep; j++)
+                if (sweep[j].s == sweep[i].s && sweep[j].b == sweep[i].b && sweep[j].E > maxE)
+                    maxE = sweep[j].E;
+            initStackDistance(&engines[nengines++], sweep[i].s, sweep[i].b, maxE);
+        }
+
+        start = wallClock();
+        replayStackDistance(trace_file, engines, nengines);
+
+        if (output_file) {
+            run_info_t run = { trace_file, "stack-distance", wallClock() - start };
+            writeReport(output_file, format, &run, NULL, 0, NULL, 0, engines, nengines);
+        }
+        for (int i = 0; i < nengines; i++) {
+            printStackDistance(&engines[i]);
+            freeStackDistance(&engines[i]);
+        }
+        if (profile.enabled)
+            printProfile();
+        free(engines);
+        free(sweep);
+        return 0;
+    }
+
+    /* Sampling stands in for the full model, so it observes nothing else */
+    if ((sample_sets || sample_window) && (prefetch != PREFETCH_NONE || detail || tlb_levels)) {
+        printf("%s: sampling cannot be combined with --prefetch, --detail or --tlb\n", argv[0]);
+        exit(1);
+    }
+    if (sample_sets && sample_window) {
+        printf("%s: pick one of --sample-sets and --sample-time\n", argv[0]);
+        exit(1);
+    }
+    if ((sample_sets || sample_window) && interval) {
+        printf("%s: --interval needs every access, not a sample\n", argv[0]);
+        exit(1);
+    }
+
+    /* A sweep replaces the single -s/-E/-b configuration */
+    if (nsweep > 0) {
+        if (trace_file == NULL) {
+            printf("%s: Missing required command line argument\n", argv[0]);
+            printUsage(argv);
+            exit(1);
+        }
+        cache_t* caches = malloc(nsweep * sizeof(cache_t));
+        prefetcher_t* prefetchers = NULL;
+        detail_t* details = NULL;
+        sampling_t* samplings = NULL;
+        interval_t* intervals = NULL;
+        tlb_t* tlbs = NULL;
+        if (prefetch != PREFETCH_NONE)
+            prefetchers = malloc(nsweep * sizeof(prefetcher_t));
+        if (detail)
+            details = malloc(nsweep * sizeof(detail_t));
+        if (sample_sets || sample_window)
+            samplings = malloc(nsweep * sizeof(sampling_t));
+        if (interval)
+            intervals = malloc(nsweep * sizeof(interval_t));
+        if (tlb_levels)
+            tlbs = malloc(nsweep * sizeof(tlb_t));
+        if (!caches || (prefetch != PREFETCH_NONE && !prefetchers) || (detail && !details) ||
+            ((sample_sets || sample_window) && !samplings) || (interval && !intervals) ||
+            (tlb_levels && !tlbs)) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            exit(1);
+        }
+        for (int i = 0; i < nsweep; i++) {
+            initCache(&caches[i], sweep[i].s, sweep[i].E, sweep[i].b, policy, write_mode);
+            caches[i].split_lines = split_lines;
+            if (prefetchers) {
+                initPrefetcher(&prefetchers[i], prefetch, prefetch_degree, prefetch_latency);
+                caches[i].prefetcher = &prefetchers[i];
+            }
+            if (details)
+                initDetail(&details[i], &caches[i], region_bits, ranges_file ? &ranges : NULL);
+            if (samplings)
+                initSampling(&samplings[i], &caches[i], sample_sets,
+                             sample_window, sample_period, sample_warmup);
+            if (intervals)
+                initInterval(&intervals[i], &caches[i], interval);
+            if (tlbs)
+                initTlb(&tlbs[i], &caches[i], tlb_levels, tlb_entries, tlb_ways, page_bits, policy);
+        }
+
+        if (restore_file)
+            restoreCheckpoint(restore_file, caches, nsweep, trace_file);
+
+        start = wallClock();
+        if (perf_mem)
+            replayLive(argv + optind, caches, nsweep, perf_period);
+        else
+            replayTrace(trace_file, caches, nsweep);
+        for (int i = 0; samplings && i < nsweep; i++)
+            finishSampling(&caches[i]);
+        for (int i = 0; intervals && i < nsweep; i++)
+            finishInterval(&caches[i]);
+
+        printSweep(caches, nsweep);
+        if (profile.enabled)
+            printProfile();
+        if (output_file) {
+            run_info_t run = { trace_file, "sweep", wallClock() - start };
+            writeReport(output_file, format, &run, caches, nsweep, NULL, 0, NULL, 0);
+        }
+        for (int i = 0; i < nsweep; i++) {
+            freeCache(&caches[i]);
+            if (details)
+                freeDetail(&details[i]);
+            if (samplings)
+                freeSampling(&samplings[i]);
+            if (intervals)
+                freeInterval(&intervals[i]);
+            if (tlbs)
+                freeTlb(&tlbs[i]);
+        }
+        free(caches);
+        free(prefetchers);
+        free(details);
+        free(samplings);
+        free(intervals);
+        free(tlbs);
+        free(sweep);
+        if (ranges_file)
+            unloadRanges(&ranges);
+        return 0;
+    }
+
     /* Make sure that all required command line args were specified */
     if (s == 0 || E == 0 || b == 0 || trace_file == NULL) {
         printf("%s: Missing required command line argument\n", argv[0]);
@@ -381,14 +6505,88 @@ int main(int argc, char* argv[])
     }
 
     /* Initialize cache */
-    initCache();
+    cache_t cache;
+    initCache(&cache, s, E, b, policy, write_mode);
+    cache.split_lines = split_lines;
+    prefetcher_t prefetcher;
+    if (prefetch != PREFETCH_NONE) {
+        initPrefetcher(&prefetcher, prefetch, prefetch_degree, prefetch_latency);
+        cache.prefetcher = &prefetcher;
+    }
+    detail_t details;
+    if (detail)
+        initDetail(&details, &cache, region_bits, ranges_file ? &ranges : NULL);
+    sampling_t* sampling = NULL;
+    if (sample_sets || sample_window) {
+        sampling = malloc(sizeof(sampling_t));
+        if (!sampling) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            exit(1);
+        }
+        initSampling(sampling, &cache, sample_sets, sample_window, sample_period, sample_warmup);
+    }
+    interval_t intervals;
+    if (interval)
+        initInterval(&intervals, &cache, interval);
+    tlb_t tlb;
+    if (tlb_levels)
+        initTlb(&tlb, &cache, tlb_levels, tlb_entries, tlb_ways, page_bits, policy);
  
-    replayTrace(trace_file);
+    if (restore_file)
+        restoreCheckpoint(restore_file, &cache, 1, trace_file);
+
+    start = wallClock();
+    if (perf_mem)
+        replayLive(argv + optind, &cache, 1, perf_period);
+    else
+        replayTrace(trace_file, &cache, 1);
+    if (sampling)
+        finishSampling(&cache);
+    if (interval)
+        finishInterval(&cache);
+    double seconds = wallClock() - start;
 
     /* Free allocated memory */
-    freeCache();
+    freeCache(&cache);
 
     /* Output the hit and miss statistics for the autograder */
-    printSummary(hit_count, miss_count, eviction_count);
+    printSummary(cache.hit_count, cache.miss_count, cache.eviction_count);
+    if (write_stats)
+        printWrites(&cache);
+    if (split_lines)
+        printf("line-crossings:%llu\n", cache.line_crossing_count);
+    if (cache.prefetcher)
+        printPrefetches(&cache);
+    if (cache.tlb) {
+        printTlb(cache.tlb);
+        printf("\n");
+    }
+    if (latency.enabled) {
+        printCost(cacheCost(&cache));
+        printf("\n");
+    }
+    if (cache.detail)
+        printDetail(&cache, detail_top);
+    if (sampling)
+        printSampling(&cache);
+    if (profile.enabled)
+        printProfile();
+    if (output_file) {
+        run_info_t run = { trace_file, "single", seconds };
+        writeReport(output_file, format, &run, &cache, 1, NULL, 0, NULL, 0);
+    }
+    if (cache.detail)
+        freeDetail(&details);
+    if (sampling) {
+        freeSampling(sampling);
+        free(sampling);
+    }
+    if (interval)
+        freeInterval(&intervals);
+    if (tlb_levels)
+        freeTlb(&tlb);
+    if (ranges_file)
+        unloadRanges(&ranges);
     return 0;
 }
+#endif /* CSIM_LIBRARY */
@@ -0,0 +1,80 @@
+/*
+ * csim.h - Library interface to the cache simulator in csim.c
+ *
+ * Built with -DCSIM_LIBRARY, csim.c leaves out main() and can be linked
+ * into a tool, such as a Pin or DynamoRIO client, that feeds it accesses
+ * as they happen instead of writing a trace:
+ *
+ *     gcc -O2 -DCSIM_LIBRARY -fPIC -c csim.c
+ *
+ * Everything in csim.c but the calls below then has internal linkage.
+ * Each csim_t holds all the state of one cache and nothing is shared
+ * between handles, so different handles can be used from different
+ * threads at once. Calls on one handle must not overlap.
+ */
+#ifndef CSIM_H
+#define CSIM_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CSIM_API __attribute__((visibility("default")))
+
+typedef struct csim csim_t;
+
+/* Flags of csim_create(); 0 is a write-back, write-allocate cache */
+#define CSIM_WRITE_THROUGH     1 /* stores go to memory instead of dirtying the line */
+#define CSIM_NO_WRITE_ALLOCATE 2 /* store misses do not fill a line */
+#define CSIM_SPLIT_LINES       4 /* split accesses across the blocks they touch */
+
+/* Counters of one cache since csim_create() */
+typedef struct csim_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long dirty_evictions;
+    unsigned long long write_bytes;    /* written to the level below */
+    unsigned long long line_crossings; /* accesses split over several blocks */
+} csim_stats_t;
+
+/*
+ * csim_create - a cache of 2^s sets of E lines of 2^b bytes that replaces
+ * lines by policy ("lru", "fifo", "random", "plru", "srrip", "brrip",
+ * "lfu", or NULL for lru), with 1 <= s + b <= 63. Returns NULL with errno
+ * set to EINVAL if the configuration is invalid or ENOMEM if it does not
+ * fit in memory.
+ */
+CSIM_API csim_t* csim_create(int s, int E, int b, const char* policy, int flags);
+
+/*
+ * csim_access - one access of len bytes at addr; op is 'L' for a load,
+ * 'S' for a store or 'M' for a load followed by a store. Any other op is
+ * ignored. Returns the number of misses the access caused.
+ */
+CSIM_API int csim_access(csim_t* sim, char op, unsigned long long addr, unsigned int len);
+
+/*
+ * csim_access_batch - the n accesses (ops[i], addrs[i], lens[i]) in order,
+ * each op 'L' or 'S'; much cheaper per access than csim_access()
+ */
+CSIM_API void csim_access_batch(csim_t* sim, const char* ops, const unsigned long long* addrs,
+                                const unsigned int* lens, size_t n);
+
+/*
+ * csim_stats - copy the counters of sim into stats
+ */
+CSIM_API void csim_stats(const csim_t* sim, csim_stats_t* stats);
+
+/*
+ * csim_destroy - free sim and everything it holds; NULL is ignored
+ */
+CSIM_API void csim_destroy(csim_t* sim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CSIM_H */